@@ -0,0 +1,252 @@
+#ifndef ATTRQ_H
+#define ATTRQ_H
+
+/*Attribute changes (mode, owner, times and xattrs) made in upper and
+  still to be made in lower.
+
+  A path has at most one entry, holding the end result of every change
+  queued for it, so a chmod -R followed by a chown -R is one trip to
+  lower per file rather than two.  An entry merged into keeps its place
+  in the queue.  Entries stay queued while they are being made, with a
+  version to tell whether more came in meanwhile, so anyone reading
+  attributes through the queue never sees them flip back.  Changes
+  that fail stay queued too, to be taken again once they're due.
+
+  Not thread-safe: terminusestfs keeps these under pending_commits_lock.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iterator>
+#include <list>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct attr_change
+{
+     bool set_mode = false;
+     mode_t mode = 0;
+     uid_t uid = (uid_t) -1;       //-1 for unchanged, as for chown
+     gid_t gid = (gid_t) -1;
+     struct timespec times[2] = {{0,UTIME_OMIT},{0,UTIME_OMIT}};
+     //xattrs set, or removed where there's no value.
+     std::map<std::string,std::optional<std::string>> xattrs;
+
+     //Turn UTIME_NOW into the time now, so every layer gets the same.
+     void resolve_now()
+     {
+          struct timespec now;
+          clock_gettime(CLOCK_REALTIME,&now);
+          for(auto& x : times)
+               if(x.tv_nsec==UTIME_NOW)
+                    x = now;
+     }
+
+     //Fold in a change made after this one.
+     void merge(const attr_change& later)
+     {
+          if(later.set_mode)
+          {
+               set_mode = true;
+               mode = later.mode;
+          }
+          if(later.uid!=(uid_t) -1)
+               uid = later.uid;
+          if(later.gid!=(gid_t) -1)
+               gid = later.gid;
+          for(int i=0; i<2; i++)
+               if(later.times[i].tv_nsec!=UTIME_OMIT)
+                    times[i] = later.times[i];
+          for(const auto& x : later.xattrs)
+               xattrs[x.first] = x.second;
+     }
+
+     //What stat will say once this is made.
+     void overlay(struct stat& st) const
+     {
+          if(set_mode)
+               st.st_mode = (st.st_mode & S_IFMT) | (mode & 07777);
+          if(uid!=(uid_t) -1)
+               st.st_uid = uid;
+          if(gid!=(gid_t) -1)
+               st.st_gid = gid;
+          if(times[0].tv_nsec!=UTIME_OMIT)
+               st.st_atim = times[0];
+          if(times[1].tv_nsec!=UTIME_OMIT)
+               st.st_mtim = times[1];
+     }
+
+     /*Make the change to rel under root: owner first, so it can't clear
+       a setuid bit the mode sets, and times last, so nothing else
+       bumps them.  Returns 0 or the first -errno.*/
+     int apply(int root, const std::string& rel) const
+     {
+          int res = 0;
+          auto check = [&](int r)
+               {
+                    if(r==-1 && !res)
+                         res = -errno;
+               };
+          if(uid!=(uid_t) -1 || gid!=(gid_t) -1)
+               check(fchownat(root,rel.c_str(),uid,gid,AT_SYMLINK_NOFOLLOW));
+          if(set_mode)
+               check(fchmodat(root,rel.c_str(),mode,0));
+          if(!xattrs.empty())
+          {
+               //The xattr calls have no *at() versions; go through /proc.
+               std::string proc = "/proc/self/fd/"+std::to_string(root)+"/"+rel;
+               for(const auto& x : xattrs)
+                    if(x.second)
+                         check(lsetxattr(proc.c_str(),x.first.c_str(),x.second->data(),x.second->size(),0));
+                    else if(lremovexattr(proc.c_str(),x.first.c_str())==-1 && errno!=ENODATA)
+                         check(-1);
+          }
+          if(times[0].tv_nsec!=UTIME_OMIT || times[1].tv_nsec!=UTIME_OMIT)
+               check(utimensat(root,rel.c_str(),times,AT_SYMLINK_NOFOLLOW));
+          return res;
+     }
+};
+
+class attr_queue
+{
+public:
+     struct item
+     {
+          std::string path;
+          attr_change change;
+          unsigned long version;
+          unsigned failures = 0;   //tries in a row that failed
+          time_t due = 0;          //not to be taken before
+     };
+
+     //Queue change for path, on top of whatever is queued for it.
+     //Returns whether something was.
+     bool push(const std::string& path, const attr_change& change)
+     {
+          auto it = by_path.find(path);
+          if(it!=by_path.end())
+          {
+               it->second->change.merge(change);
+               it->second->version++;
+               //What failed may not be what's queued now.
+               it->second->due = 0;
+               return true;
+          }
+          order.push_back({path,change,0});
+          by_path.emplace(path,std::prev(order.end()));
+          return false;
+     }
+
+     //What's queued for path, or NULL.
+     const attr_change* find(const std::string& path) const
+     {
+          auto it = by_path.find(path);
+          return it==by_path.end() ? NULL : &it->second->change;
+     }
+
+     //Drop path.  Returns whether it was queued.
+     bool cancel(const std::string& path)
+     {
+          auto it = by_path.find(path);
+          if(it==by_path.end())
+               return false;
+          order.erase(it->second);
+          by_path.erase(it);
+          return true;
+     }
+
+     //Move everything at or under from to the same place under to.
+     void rename(const std::string& from, const std::string& to)
+     {
+          std::vector<std::list<item>::iterator> moved;
+          auto it = by_path.find(from);
+          if(it!=by_path.end())
+          {
+               moved.push_back(it->second);
+               by_path.erase(it);
+          }
+          //Everything under from sorts together, straight after from+"/".
+          std::string fdir = from+"/";
+          for(it = by_path.lower_bound(fdir); it!=by_path.end() && !it->first.compare(0,fdir.length(),fdir);)
+          {
+               moved.push_back(it->second);
+               it = by_path.erase(it);
+          }
+          for(auto x : moved)
+          {
+               x->path = to+x->path.substr(from.length());
+               cancel(x->path);
+               by_path.emplace(x->path,x);
+          }
+     }
+
+     /*Copy out up to max entries due by now, oldest first, that skip
+       doesn't turn down, looking at no more than scan.  The ones turned
+       down or not due go to the back, so they can't keep the rest
+       waiting.  Entries taken stay queued until done or failed.*/
+     template<typename Predicate>
+     size_t take(time_t now, Predicate skip, size_t max, size_t scan, std::vector<item>& items)
+     {
+          size_t taken = 0;
+          for(auto it = order.begin(); taken<max && scan && it!=order.end(); scan--)
+          {
+               auto next = std::next(it);
+               if(it->due > now || skip(it->path))
+                    order.splice(order.end(),order,it);
+               else
+               {
+                    items.push_back(*it);
+                    taken++;
+               }
+               it = next;
+          }
+          return taken;
+     }
+
+     //A change taken has been made.  Drops it unless more came in since.
+     void done(const std::string& path, unsigned long version)
+     {
+          auto it = by_path.find(path);
+          if(it!=by_path.end() && it->second->version==version)
+          {
+               order.erase(it->second);
+               by_path.erase(it);
+          }
+     }
+
+     //A change taken couldn't be made.  It stays queued, to be taken
+     //again at due unless more has come in since.
+     void failed(const std::string& path, unsigned long version, time_t due)
+     {
+          auto it = by_path.find(path);
+          if(it==by_path.end())
+               return;
+          it->second->failures++;
+          if(it->second->version==version)
+               it->second->due = due;
+     }
+
+     size_t size() const
+     {
+          return by_path.size();
+     }
+
+     bool empty() const
+     {
+          return by_path.empty();
+     }
+
+private:
+     std::list<item> order;
+     //Ordered, so a directory's entries can be found without a full scan.
+     std::map<std::string,std::list<item>::iterator> by_path;
+};
+
+#endif
@@ -0,0 +1,116 @@
+/*
+  Microbenchmark: the indexed commit_queue against the
+  list<pair<string,time_t>> pending_commits used to be.
+
+  g++ -O2 -std=c++17 -I.. commitq_bench.cpp -o commitq_bench
+  ./commitq_bench [files] [writes]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <list>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "commitq.h"
+
+using namespace std;
+
+static double now()
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC,&ts);
+     return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void report(const char* what, const char* impl, double seconds, size_t ops)
+{
+     printf("%-8s %-6s %10zu ops %12.1f ns/op\n",what,impl,ops,seconds*1e9/ops);
+}
+
+int main(int argc, char* argv[])
+{
+     size_t files = argc > 1 ? atol(argv[1]) : 100000;
+     size_t writes = argc > 2 ? atol(argv[2]) : 20000;
+
+     vector<string> paths;
+     for(size_t i=0; i<files; i++)
+          paths.push_back("/build/obj/dir"+to_string(i%1000)+"/file"+to_string(i)+".o");
+
+     mt19937 rng(42);
+     vector<size_t> order;
+     for(size_t i=0; i<writes; i++)
+          order.push_back(rng()%files);
+
+     list<pair<string,time_t>> l;
+     commit_queue q;
+     time_t t = 0;
+     double start;
+
+     //Fill both with every file
+     start = now();
+     for(const auto& x : paths)
+          l.emplace_back(x,t++);
+     report("enqueue","list",now()-start,files);
+     t = 0;
+     start = now();
+     for(const auto& x : paths)
+          q.push(x,t++);
+     report("enqueue","index",now()-start,files);
+
+     //A write requeues its file: two remove_if passes and an append,
+     //as handle_write did.
+     list<pair<string,time_t>> luc;
+     start = now();
+     for(auto i : order)
+     {
+          const string& path = paths[i];
+          l.remove_if([&](const pair<string,time_t>& x) { return x.first==path; });
+          luc.remove_if([&](const pair<string,time_t>& x) { return x.first==path; });
+          l.emplace_back(path,t++);
+     }
+     report("requeue","list",now()-start,writes);
+     commit_queue qluc;
+     start = now();
+     for(auto i : order)
+     {
+          qluc.cancel(paths[i]);
+          q.push(paths[i],t++);
+     }
+     report("requeue","index",now()-start,writes);
+
+     //handle_read's pending_luc check
+     start = now();
+     size_t found = 0;
+     for(auto i : order)
+          found += find_if(l.begin(),l.end(),
+                           [&](const pair<string,time_t>& x) { return x.first==paths[i]; })!=l.end();
+     report("lookup","list",now()-start,writes);
+     start = now();
+     for(auto i : order)
+          found += q.contains(paths[i]);
+     report("lookup","index",now()-start,writes);
+
+     //Drain everything that's due
+     start = now();
+     size_t drained = 0;
+     while(l.size() && l.front().second<=t)
+     {
+          l.pop_front();
+          drained++;
+     }
+     report("pop-due","list",now()-start,drained);
+     start = now();
+     drained = 0;
+     string path;
+     time_t due;
+     while(q.pop_due(t,[](const string&) { return false; },path,due))
+          drained++;
+     report("pop-due","index",now()-start,drained);
+
+     return found==2*writes ? 0 : 1;
+}
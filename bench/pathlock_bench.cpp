@@ -0,0 +1,144 @@
+/*
+  Stress test and benchmark for plocklib's path locks: getattr
+  throughput while other threads copy files up.
+
+  "global" mimics the old protocol: one rwlock taken as reader by every
+  getattr, promoted to writer to freeze and unfreeze each copy-up, with
+  waiters polling the frozen set every 100 ms.  "paths" uses the
+  hierarchical path table the way terminusestfs does now.
+
+  g++ -O2 -std=c++17 -pthread -I.. pathlock_bench.cpp -o pathlock_bench
+  ./pathlock_bench [getattr threads] [copy-up threads] [copy ms] [seconds]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "plocklib.h"
+
+using namespace std;
+
+static vector<string> paths;
+static atomic<bool> stop;
+static atomic<unsigned long> getattrs, copyups, waits;
+
+static plocklib_rw_lock global_lock = PTHREAD_RWLOCK_INITIALIZER;
+static set<string> frozen;
+static plocklib_path_table table;
+
+static void fake_getattr(const string& path)
+{
+     struct stat st;
+     lstat("/",&st);
+     (void) path;
+}
+
+static void global_getattr(mt19937& rng)
+{
+     const string& path = paths[rng()%paths.size()];
+     plocklib_become_reader(&global_lock);
+     while(frozen.count(path))
+     {
+          waits++;
+          plocklib_resign_as_reader(&global_lock);
+          usleep(100000);
+          plocklib_become_reader(&global_lock);
+     }
+     fake_getattr(path);
+     plocklib_resign_as_reader(&global_lock);
+}
+
+static void global_copyup(mt19937& rng, unsigned copy_ms)
+{
+     const string& path = paths[rng()%paths.size()];
+     plocklib_become_reader(&global_lock);
+     plocklib_request_writer_promotion(&global_lock);
+     frozen.insert(path);
+     plocklib_resign_as_writer(&global_lock);
+     usleep(copy_ms*1000);
+     plocklib_become_reader(&global_lock);
+     plocklib_request_writer_promotion(&global_lock);
+     frozen.erase(path);
+     plocklib_resign_as_writer(&global_lock);
+}
+
+static void paths_getattr(mt19937& rng)
+{
+     const string& path = paths[rng()%paths.size()];
+     plocklib_lock_path(&table,path,PLOCKLIB_IS);
+     fake_getattr(path);
+     plocklib_unlock_path(&table,path,PLOCKLIB_IS);
+}
+
+static void paths_copyup(mt19937& rng, unsigned copy_ms)
+{
+     const string& path = paths[rng()%paths.size()];
+     plocklib_lock_path(&table,path,PLOCKLIB_X);
+     usleep(copy_ms*1000);
+     plocklib_unlock_path(&table,path,PLOCKLIB_X);
+}
+
+static void run(const char* name, bool global, unsigned readers, unsigned copiers, unsigned copy_ms, unsigned seconds)
+{
+     stop = false;
+     getattrs = copyups = waits = 0;
+     vector<thread> threads;
+     for(unsigned i=0; i<readers; i++)
+          threads.emplace_back([=]()
+                               {
+                                    mt19937 rng(i);
+                                    while(!stop)
+                                    {
+                                         if(global)
+                                              global_getattr(rng);
+                                         else
+                                              paths_getattr(rng);
+                                         getattrs++;
+                                    }
+                               });
+     for(unsigned i=0; i<copiers; i++)
+          threads.emplace_back([=]()
+                               {
+                                    mt19937 rng(1000+i);
+                                    while(!stop)
+                                    {
+                                         if(global)
+                                              global_copyup(rng,copy_ms);
+                                         else
+                                              paths_copyup(rng,copy_ms);
+                                         copyups++;
+                                    }
+                               });
+     sleep(seconds);
+     stop = true;
+     for(auto& x : threads)
+          x.join();
+     printf("%-6s %12.0f getattr/s %8.1f copy-ups/s %8lu frozen waits\n",
+            name,(double)getattrs/seconds,(double)copyups/seconds,waits.load());
+}
+
+int main(int argc, char* argv[])
+{
+     unsigned readers = argc > 1 ? atoi(argv[1]) : 8;
+     unsigned copiers = argc > 2 ? atoi(argv[2]) : 4;
+     unsigned copy_ms = argc > 3 ? atoi(argv[3]) : 5;
+     unsigned seconds = argc > 4 ? atoi(argv[4]) : 5;
+
+     for(int d=0; d<100; d++)
+          for(int f=0; f<100; f++)
+               paths.push_back("/src/dir"+to_string(d)+"/file"+to_string(f));
+
+     run("global",true,readers,copiers,copy_ms,seconds);
+     run("paths",false,readers,copiers,copy_ms,seconds);
+     return 0;
+}
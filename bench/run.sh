@@ -0,0 +1,93 @@
+#!/bin/sh
+#
+# Mount terminusestfs over a slowfs lower layer in a scratch directory,
+# run workloads in it, and tear everything down again.
+#
+#   TEFS=../terminusestfs ./run.sh [workload...]
+#
+# Workloads are the ones workload.cpp knows, "all" by default.  Set in
+# the environment:
+#
+#   TEFS         the terminusestfs binary (default ../terminusestfs)
+#   LATENCY_US   added to every lower layer request (default 2000)
+#   BANDWIDTH    lower layer bytes per second, 0 for no limit (default 0)
+#   TEFS_OPTS    extra -o options for terminusestfs
+#   FILES        files, or operations, per workload (default 10000)
+#   SIZE         bytes in the big file workloads (default 268435456)
+#   TARBALL      a source tree to unpack for the untar workload
+#   SCRATCH      an empty directory to put the layers in (default a new
+#                one in /tmp, which is removed afterwards)
+#
+# slowfs and workload are built here first if they're missing or out
+# of date.
+
+set -e
+cd "$(dirname "$0")"
+[ $# -gt 0 ] || set -- all
+
+TEFS=${TEFS:-../terminusestfs}
+LATENCY_US=${LATENCY_US:-2000}
+BANDWIDTH=${BANDWIDTH:-0}
+FILES=${FILES:-10000}
+SIZE=${SIZE:-268435456}
+if [ -z "$SCRATCH" ]; then
+     SCRATCH=$(mktemp -d /tmp/tefs-bench.XXXXXX)
+     made_scratch=1
+fi
+
+if [ ! -x "$TEFS" ]; then
+     echo "no terminusestfs binary at $TEFS; set TEFS" >&2
+     exit 1
+fi
+if [ ! -x slowfs ] || [ slowfs.cpp -nt slowfs ]; then
+     g++ -O2 -std=c++17 slowfs.cpp -o slowfs $(pkg-config fuse3 --cflags --libs)
+fi
+if [ ! -x workload ] || [ workload.cpp -nt workload ]; then
+     g++ -O2 -std=c++17 workload.cpp -o workload
+fi
+
+mkdir -p "$SCRATCH/backing" "$SCRATCH/lower" "$SCRATCH/upper" "$SCRATCH/mnt"
+
+# terminusestfs goes on committing after it's unmounted, so wait for
+# it to finish before taking lower away.
+cleanup()
+{
+     fusermount3 -u "$SCRATCH/mnt" 2>/dev/null || true
+     [ -z "$tefs_pid" ] || wait $tefs_pid || true
+     fusermount3 -u "$SCRATCH/lower" 2>/dev/null || true
+     [ -z "$slowfs_pid" ] || wait $slowfs_pid || true
+     [ -z "$made_scratch" ] || rm -rf "$SCRATCH"
+}
+trap cleanup EXIT INT TERM
+
+# Wait up to 5 seconds for a command to succeed.
+wait_for()
+{
+     tries=0
+     until "$@"; do
+          tries=$((tries+1))
+          if [ $tries -gt 50 ]; then
+               echo "gave up waiting for $*" >&2
+               exit 1
+          fi
+          sleep 0.1
+     done
+}
+
+./slowfs "$SCRATCH/backing" "$SCRATCH/lower" -f -o latency_us=$LATENCY_US,bandwidth=$BANDWIDTH &
+slowfs_pid=$!
+wait_for mountpoint -q "$SCRATCH/lower"
+# Commit as soon as possible, so commit lag measures the commit path
+# rather than the delay.
+"$TEFS" "$SCRATCH/upper" "$SCRATCH/lower" "$SCRATCH/mnt" -f \
+     -o commit_delay=0,commit_max_delay=0${TEFS_OPTS:+,$TEFS_OPTS} &
+tefs_pid=$!
+
+# The mount is ready once its stats file is.
+wait_for test -r "$SCRATCH/mnt/.tefs/stats"
+
+echo "lower latency ${LATENCY_US}us, bandwidth ${BANDWIDTH} B/s${TEFS_OPTS:+, options $TEFS_OPTS}"
+./workload -n "$FILES" -s "$SIZE" ${TARBALL:+-t "$TARBALL"} "$SCRATCH/mnt" "$@"
+
+echo
+cat "$SCRATCH/mnt/.tefs/stats"
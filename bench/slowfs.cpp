@@ -0,0 +1,352 @@
+/*
+  A stand-in for a slow lower layer: a passthrough FUSE filesystem over
+  a local directory that adds a fixed latency to every request and
+  shares a bandwidth limit between all reads and writes.
+
+  g++ -O2 -std=c++17 slowfs.cpp -o slowfs $(pkg-config fuse3 --cflags --libs)
+  ./slowfs backing_dir mountpoint [-o latency_us=N,bandwidth=N] [FUSE options]
+
+  latency_us is added to every request (default 2000); bandwidth is in
+  bytes per second, 0 for no limit (default 0).
+*/
+
+#define FUSE_USE_VERSION 31
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+
+using namespace std;
+
+static int backing_fd;
+
+static struct slowfs_config
+{
+     unsigned latency_us;
+     unsigned long bandwidth;
+} config = {2000, 0};
+
+#define SLOWFS_OPT(t, p) { t, offsetof(struct slowfs_config, p), 1 }
+static const struct fuse_opt slowfs_opts[] = {
+     SLOWFS_OPT("latency_us=%u", latency_us),
+     SLOWFS_OPT("bandwidth=%lu", bandwidth),
+     FUSE_OPT_END
+};
+
+static double monotonic_now()
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC,&ts);
+     return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+//Every request waits out the latency; ones moving data then wait for
+//their turn at the bandwidth, handed out in virtual time like
+//terminusestfs's commit throttle.
+static void delay(size_t bytes = 0)
+{
+     static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+     static double next_byte = 0;
+
+     if(config.latency_us)
+          usleep(config.latency_us);
+     if(!bytes || !config.bandwidth)
+          return;
+
+     pthread_mutex_lock(&lock);
+     double now = monotonic_now();
+     next_byte = max(next_byte,now);
+     double start = next_byte;
+     next_byte += (double)bytes/config.bandwidth;
+     pthread_mutex_unlock(&lock);
+
+     if(start > now)
+          usleep((useconds_t)((start-now)*1000000));
+}
+
+static string rel(const char* path)
+{
+     return path[1] ? string(path+1) : string(".");
+}
+
+static int result(int res)
+{
+     return res==-1 ? -errno : 0;
+}
+
+static int slow_getattr(const char* path, struct stat* st, struct fuse_file_info* fi)
+{
+     delay();
+     if(fi)
+          return result(fstat(fi->fh,st));
+     return result(fstatat(backing_fd,rel(path).c_str(),st,AT_SYMLINK_NOFOLLOW));
+}
+
+static int slow_readlink(const char* path, char* buf, size_t size)
+{
+     delay();
+     ssize_t len = readlinkat(backing_fd,rel(path).c_str(),buf,size-1);
+     if(len==-1)
+          return -errno;
+     buf[len] = '\0';
+     return 0;
+}
+
+static int slow_mknod(const char* path, mode_t mode, dev_t rdev)
+{
+     delay();
+     return result(mknodat(backing_fd,rel(path).c_str(),mode,rdev));
+}
+
+static int slow_mkdir(const char* path, mode_t mode)
+{
+     delay();
+     return result(mkdirat(backing_fd,rel(path).c_str(),mode));
+}
+
+static int slow_unlink(const char* path)
+{
+     delay();
+     return result(unlinkat(backing_fd,rel(path).c_str(),0));
+}
+
+static int slow_rmdir(const char* path)
+{
+     delay();
+     return result(unlinkat(backing_fd,rel(path).c_str(),AT_REMOVEDIR));
+}
+
+static int slow_symlink(const char* from, const char* to)
+{
+     delay();
+     return result(symlinkat(from,backing_fd,rel(to).c_str()));
+}
+
+static int slow_rename(const char* from, const char* to, unsigned int flags)
+{
+     delay();
+     if(flags)
+          return -EINVAL;
+     return result(renameat(backing_fd,rel(from).c_str(),backing_fd,rel(to).c_str()));
+}
+
+static int slow_link(const char* from, const char* to)
+{
+     delay();
+     return result(linkat(backing_fd,rel(from).c_str(),backing_fd,rel(to).c_str(),0));
+}
+
+static int slow_chmod(const char* path, mode_t mode, struct fuse_file_info* fi)
+{
+     delay();
+     return result(fchmodat(backing_fd,rel(path).c_str(),mode,0));
+}
+
+static int slow_chown(const char* path, uid_t uid, gid_t gid, struct fuse_file_info* fi)
+{
+     delay();
+     return result(fchownat(backing_fd,rel(path).c_str(),uid,gid,AT_SYMLINK_NOFOLLOW));
+}
+
+static int slow_truncate(const char* path, off_t size, struct fuse_file_info* fi)
+{
+     delay();
+     if(fi)
+          return result(ftruncate(fi->fh,size));
+     int fd = openat(backing_fd,rel(path).c_str(),O_WRONLY);
+     if(fd==-1)
+          return -errno;
+     int res = result(ftruncate(fd,size));
+     close(fd);
+     return res;
+}
+
+static int slow_utimens(const char* path, const struct timespec ts[2], struct fuse_file_info* fi)
+{
+     delay();
+     return result(utimensat(backing_fd,rel(path).c_str(),ts,AT_SYMLINK_NOFOLLOW));
+}
+
+static int slow_open(const char* path, struct fuse_file_info* fi)
+{
+     delay();
+     int fd = openat(backing_fd,rel(path).c_str(),fi->flags);
+     if(fd==-1)
+          return -errno;
+     fi->fh = fd;
+     return 0;
+}
+
+static int slow_create(const char* path, mode_t mode, struct fuse_file_info* fi)
+{
+     delay();
+     int fd = openat(backing_fd,rel(path).c_str(),fi->flags | O_CREAT,mode);
+     if(fd==-1)
+          return -errno;
+     fi->fh = fd;
+     return 0;
+}
+
+static int slow_read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+     delay(size);
+     ssize_t res = pread(fi->fh,buf,size,offset);
+     return res==-1 ? -errno : res;
+}
+
+static int slow_write(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* fi)
+{
+     delay(size);
+     ssize_t res = pwrite(fi->fh,buf,size,offset);
+     return res==-1 ? -errno : res;
+}
+
+static int slow_statfs(const char* path, struct statvfs* st)
+{
+     delay();
+     return result(fstatvfs(backing_fd,st));
+}
+
+static int slow_release(const char* path, struct fuse_file_info* fi)
+{
+     close(fi->fh);
+     return 0;
+}
+
+static int slow_fsync(const char* path, int datasync, struct fuse_file_info* fi)
+{
+     delay();
+     return result(datasync ? fdatasync(fi->fh) : fsync(fi->fh));
+}
+
+//The xattr calls have no *at() versions; go through /proc.
+static string proc_path(const char* path)
+{
+     return "/proc/self/fd/"+to_string(backing_fd)+"/"+rel(path);
+}
+
+static int slow_setxattr(const char* path, const char* name, const char* value, size_t size, int flags)
+{
+     delay();
+     return result(lsetxattr(proc_path(path).c_str(),name,value,size,flags));
+}
+
+static int slow_getxattr(const char* path, const char* name, char* value, size_t size)
+{
+     delay();
+     ssize_t res = lgetxattr(proc_path(path).c_str(),name,value,size);
+     return res==-1 ? -errno : res;
+}
+
+static int slow_listxattr(const char* path, char* list, size_t size)
+{
+     delay();
+     ssize_t res = llistxattr(proc_path(path).c_str(),list,size);
+     return res==-1 ? -errno : res;
+}
+
+static int slow_removexattr(const char* path, const char* name)
+{
+     delay();
+     return result(lremovexattr(proc_path(path).c_str(),name));
+}
+
+static int slow_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset,
+                        struct fuse_file_info* fi, enum fuse_readdir_flags flags)
+{
+     delay();
+     int fd = openat(backing_fd,rel(path).c_str(),O_RDONLY | O_DIRECTORY);
+     if(fd==-1)
+          return -errno;
+     DIR* dp = fdopendir(fd);
+     if(!dp)
+     {
+          int res = -errno;
+          close(fd);
+          return res;
+     }
+     struct dirent* de;
+     while((de = readdir(dp)))
+     {
+          struct stat st;
+          memset(&st,0,sizeof(st));
+          st.st_ino = de->d_ino;
+          st.st_mode = DTTOIF(de->d_type);
+          if(filler(buf,de->d_name,&st,0,(enum fuse_fill_dir_flags) 0))
+               break;
+     }
+     closedir(dp);
+     return 0;
+}
+
+static void* slow_init(struct fuse_conn_info* conn, struct fuse_config* cfg)
+{
+     //Pass the backing directory's inode numbers through.
+     cfg->use_ino = 1;
+     return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+     if(argc < 3 || argv[1][0]=='-')
+     {
+          fprintf(stderr,"usage: %s backing_dir mountpoint [-o latency_us=N,bandwidth=N] [FUSE options]\n",argv[0]);
+          return 1;
+     }
+     backing_fd = open(argv[1],O_RDONLY | O_DIRECTORY);
+     if(backing_fd==-1)
+     {
+          perror(argv[1]);
+          return 1;
+     }
+     argv[1] = argv[0];
+     struct fuse_args args = FUSE_ARGS_INIT(argc-1,argv+1);
+     if(fuse_opt_parse(&args,&config,slowfs_opts,NULL)==-1)
+          return 1;
+
+     static struct fuse_operations ops;
+     ops.init = slow_init;
+     ops.getattr = slow_getattr;
+     ops.readlink = slow_readlink;
+     ops.mknod = slow_mknod;
+     ops.mkdir = slow_mkdir;
+     ops.unlink = slow_unlink;
+     ops.rmdir = slow_rmdir;
+     ops.symlink = slow_symlink;
+     ops.rename = slow_rename;
+     ops.link = slow_link;
+     ops.chmod = slow_chmod;
+     ops.chown = slow_chown;
+     ops.truncate = slow_truncate;
+     ops.utimens = slow_utimens;
+     ops.open = slow_open;
+     ops.create = slow_create;
+     ops.read = slow_read;
+     ops.write = slow_write;
+     ops.statfs = slow_statfs;
+     ops.release = slow_release;
+     ops.fsync = slow_fsync;
+     ops.setxattr = slow_setxattr;
+     ops.getxattr = slow_getxattr;
+     ops.listxattr = slow_listxattr;
+     ops.removexattr = slow_removexattr;
+     ops.readdir = slow_readdir;
+
+     int res = fuse_main(args.argc,args.argv,&ops,NULL);
+     fuse_opt_free_args(&args);
+     return res;
+}
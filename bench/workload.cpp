@@ -0,0 +1,410 @@
+/*
+  Repeatable workloads for measuring terminusestfs, run in a directory
+  (normally a terminusestfs mount over slowfs; see run.sh).
+
+  g++ -O2 -std=c++17 workload.cpp -o workload
+  ./workload [-n files] [-s bytes] [-t tarball] dir workload...
+
+  Workloads:
+    meta       create, stat and unlink n files (default 10000)
+    seqwrite   write a file of s bytes (default 256MiB) 1MiB at a time
+    seqread    read that file back 1MiB at a time
+    randwrite  n 4KiB writes at random offsets in it
+    randread   n 4KiB reads at random offsets in it
+    untar      unpack tarball, or without one, write n files of up to
+               16KiB spread over a tree of directories, like a source tree
+    append     append to one file 64KiB at a time until it's s bytes
+    rename     rename a directory of n files back and forth 100 times
+    all        all of the above, in that order
+
+  Each prints its operations per second and the 50th and 99th
+  percentile latency of one operation.  If dir is inside a
+  terminusestfs mount, each then waits for the commits it caused to
+  drain, and prints how long that took (commit lag), going by the
+  mount's /.tefs/stats.  Run with a short commit_delay for that to mean
+  anything.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static string dir;
+static string stats_file;
+static size_t files = 10000;
+static off_t bytes = 256<<20;
+static const char* tarball = NULL;
+
+static double now()
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC,&ts);
+     return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void die(const string& what)
+{
+     perror(what.c_str());
+     exit(1);
+}
+
+//A value from the mount's stats.json, or -1.
+static long stat_value(const string& name)
+{
+     ifstream in(stats_file);
+     stringstream text;
+     text << in.rdbuf();
+     string all = text.str();
+     size_t pos = all.find("\""+name+"\": ");
+     if(pos==string::npos)
+          return -1;
+     return atol(all.c_str()+pos+name.size()+4);
+}
+
+//Wait until the mount has committed everything.  Returns how many
+//seconds that took, or -1 outside terminusestfs.
+static double drain()
+{
+     if(stats_file.empty())
+          return -1;
+     double start = now();
+     while(stat_value("pending_commits")>0 || stat_value("commits_in_flight")>0 || stat_value("urgent_in_flight")>0 ||
+           stat_value("pending_attrs")>0)
+          usleep(100000);
+     return now()-start;
+}
+
+//Latencies of one workload's operations.
+struct samples
+{
+     vector<double> seconds;
+     double started = now();
+
+     //Time f as one operation.
+     template<typename Function>
+     void time(Function f)
+     {
+          double start = now();
+          f();
+          seconds.push_back(now()-start);
+     }
+
+     void report(const char* name, size_t ops = 0)
+     {
+          double elapsed = now()-started;
+          if(!ops)
+               ops = seconds.size();
+          sort(seconds.begin(),seconds.end());
+          auto percentile = [&](double p)
+               {
+                    return seconds.empty() ? 0 : seconds[min(seconds.size()-1,(size_t)(p*seconds.size()))]*1e6;
+               };
+          printf("%-10s %10zu ops %10.0f ops/s  p50 %10.1fus  p99 %10.1fus",
+                 name,ops,ops/elapsed,percentile(0.5),percentile(0.99));
+          fflush(stdout);
+          double lag = drain();
+          if(lag>=0)
+               printf("  commit lag %8.1fs",lag);
+          printf("\n");
+     }
+};
+
+static void write_all(int fd, const char* buf, size_t len, off_t offset)
+{
+     if(pwrite(fd,buf,len,offset)!=(ssize_t)len)
+          die("write");
+}
+
+static void meta()
+{
+     string base = dir+"/meta";
+     mkdir(base.c_str(),0755);
+     samples s;
+     for(size_t i=0; i<files; i++)
+     {
+          string path = base+"/f"+to_string(i);
+          s.time([&]()
+                 {
+                      int fd = open(path.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644);
+                      if(fd==-1)
+                           die(path);
+                      close(fd);
+                 });
+          struct stat st;
+          s.time([&]() { stat(path.c_str(),&st); });
+     }
+     for(size_t i=0; i<files; i++)
+     {
+          string path = base+"/f"+to_string(i);
+          s.time([&]() { unlink(path.c_str()); });
+     }
+     s.report("meta");
+}
+
+static string big_file()
+{
+     return dir+"/big";
+}
+
+static void seqwrite()
+{
+     vector<char> buf(1<<20,'x');
+     int fd = open(big_file().c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644);
+     if(fd==-1)
+          die(big_file());
+     samples s;
+     for(off_t offset = 0; offset<bytes; offset += buf.size())
+          s.time([&]() { write_all(fd,buf.data(),min<off_t>(buf.size(),bytes-offset),offset); });
+     s.time([&]() { fsync(fd); });
+     close(fd);
+     s.report("seqwrite");
+}
+
+//Make sure the big file is there, without timing it.
+static int open_big(int flags)
+{
+     struct stat st;
+     if(stat(big_file().c_str(),&st) || st.st_size<bytes)
+     {
+          vector<char> buf(1<<20,'x');
+          int fd = open(big_file().c_str(),O_WRONLY | O_CREAT,0644);
+          if(fd==-1)
+               die(big_file());
+          for(off_t offset = 0; offset<bytes; offset += buf.size())
+               write_all(fd,buf.data(),min<off_t>(buf.size(),bytes-offset),offset);
+          close(fd);
+     }
+     int fd = open(big_file().c_str(),flags);
+     if(fd==-1)
+          die(big_file());
+     //Read from the filesystem, not the page cache, where we can.
+     posix_fadvise(fd,0,0,POSIX_FADV_DONTNEED);
+     return fd;
+}
+
+static void seqread()
+{
+     int fd = open_big(O_RDONLY);
+     vector<char> buf(1<<20);
+     samples s;
+     for(off_t offset = 0; offset<bytes; offset += buf.size())
+          s.time([&]() { pread(fd,buf.data(),buf.size(),offset); });
+     close(fd);
+     s.report("seqread");
+}
+
+static void random_io(bool write)
+{
+     int fd = open_big(write ? O_RDWR : O_RDONLY);
+     vector<char> buf(4096,'y');
+     mt19937_64 rng(1);
+     samples s;
+     for(size_t i=0; i<files; i++)
+     {
+          off_t offset = (rng()%(bytes/buf.size()))*buf.size();
+          if(write)
+               s.time([&]() { write_all(fd,buf.data(),buf.size(),offset); });
+          else
+               s.time([&]() { pread(fd,buf.data(),buf.size(),offset); });
+     }
+     close(fd);
+     s.report(write ? "randwrite" : "randread");
+}
+
+static size_t count_files(const string& path)
+{
+     size_t count = 0;
+     string command = "find '"+path+"' -type f | wc -l";
+     FILE* out = popen(command.c_str(),"r");
+     if(out)
+     {
+          if(fscanf(out,"%zu",&count)!=1)
+               count = 0;
+          pclose(out);
+     }
+     return count;
+}
+
+static void untar()
+{
+     string base = dir+"/tree";
+     mkdir(base.c_str(),0755);
+     samples s;
+     if(tarball)
+     {
+          //One operation; the rate is in files.
+          pid_t pid = fork();
+          if(!pid)
+          {
+               execlp("tar","tar","-xf",tarball,"-C",base.c_str(),(char*)NULL);
+               _exit(127);
+          }
+          int status;
+          waitpid(pid,&status,0);
+          if(!WIFEXITED(status) || WEXITSTATUS(status))
+          {
+               fprintf(stderr,"tar failed\n");
+               exit(1);
+          }
+          s.report("untar",count_files(base));
+     }
+     else
+     {
+          //Around 30 files a directory, 3 levels deep.
+          mt19937 rng(2);
+          vector<char> buf(16384,'z');
+          for(size_t i=0; i<files; i++)
+          {
+               size_t d = i/30;
+               string sub = base+"/d"+to_string(d/900)+"/d"+to_string(d/30%30)+"/d"+to_string(d%30);
+               if(i%30==0)
+                    s.time([&]()
+                           {
+                                mkdir((base+"/d"+to_string(d/900)).c_str(),0755);
+                                mkdir((base+"/d"+to_string(d/900)+"/d"+to_string(d/30%30)).c_str(),0755);
+                                mkdir(sub.c_str(),0755);
+                           });
+               string path = sub+"/f"+to_string(i%30)+".c";
+               s.time([&]()
+                      {
+                           int fd = open(path.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644);
+                           if(fd==-1)
+                                die(path);
+                           write_all(fd,buf.data(),rng()%buf.size(),0);
+                           close(fd);
+                      });
+          }
+          s.report("untar");
+     }
+}
+
+static void append()
+{
+     string path = dir+"/appended";
+     int fd = open(path.c_str(),O_WRONLY | O_CREAT | O_APPEND | O_TRUNC,0644);
+     if(fd==-1)
+          die(path);
+     vector<char> buf(65536,'a');
+     samples s;
+     for(off_t done = 0; done<bytes; done += buf.size())
+          s.time([&]()
+                 {
+                      if(write(fd,buf.data(),buf.size())!=(ssize_t)buf.size())
+                           die("write");
+                 });
+     close(fd);
+     s.report("append");
+}
+
+static void rename_dir()
+{
+     string a = dir+"/renamed.a", b = dir+"/renamed.b";
+     mkdir(a.c_str(),0755);
+     for(size_t i=0; i<files; i++)
+     {
+          int fd = open((a+"/f"+to_string(i)).c_str(),O_WRONLY | O_CREAT,0644);
+          if(fd==-1)
+               die(a);
+          close(fd);
+     }
+     drain();
+     samples s;
+     for(int i=0; i<100; i++)
+          s.time([&]()
+                 {
+                      if(rename(i%2 ? b.c_str() : a.c_str(),i%2 ? a.c_str() : b.c_str()))
+                           die("rename");
+                 });
+     s.report("rename");
+}
+
+//The stats file of the terminusestfs mount dir is in, if any.
+static string find_stats(const string& from)
+{
+     char real[PATH_MAX];
+     if(!realpath(from.c_str(),real))
+          return "";
+     string path = real;
+     while(true)
+     {
+          if(!access((path+"/.tefs/stats.json").c_str(),R_OK))
+               return path+"/.tefs/stats.json";
+          if(path=="/" || path.empty())
+               return "";
+          path = path.substr(0,path.rfind('/'));
+          if(path.empty())
+               path = "/";
+     }
+}
+
+int main(int argc, char* argv[])
+{
+     int opt;
+     while((opt = getopt(argc,argv,"n:s:t:"))!=-1)
+          switch(opt)
+          {
+          case 'n':
+               files = atol(optarg);
+               break;
+          case 's':
+               bytes = atoll(optarg);
+               break;
+          case 't':
+               tarball = optarg;
+               break;
+          default:
+               fprintf(stderr,"usage: %s [-n files] [-s bytes] [-t tarball] dir workload...\n",argv[0]);
+               return 1;
+          }
+     if(optind+2 > argc)
+     {
+          fprintf(stderr,"usage: %s [-n files] [-s bytes] [-t tarball] dir workload...\n",argv[0]);
+          return 1;
+     }
+     dir = argv[optind];
+     stats_file = find_stats(dir);
+     bytes = max<off_t>(bytes,1<<20);
+
+     vector<string> workloads(argv+optind+1,argv+argc);
+     if(workloads.size()==1 && workloads[0]=="all")
+          workloads = {"meta", "seqwrite", "seqread", "randwrite", "randread", "untar", "append", "rename"};
+     for(const auto& x : workloads)
+          if(x=="meta")
+               meta();
+          else if(x=="seqwrite")
+               seqwrite();
+          else if(x=="seqread")
+               seqread();
+          else if(x=="randwrite")
+               random_io(true);
+          else if(x=="randread")
+               random_io(false);
+          else if(x=="untar")
+               untar();
+          else if(x=="append")
+               append();
+          else if(x=="rename")
+               rename_dir();
+          else
+          {
+               fprintf(stderr,"unknown workload %s\n",x.c_str());
+               return 1;
+          }
+     return 0;
+}
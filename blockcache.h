@@ -0,0 +1,247 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+/*Cache of lower-layer file blocks, kept in a scratch file on the
+  upper device.
+
+  Blocks are fixed-size and indexed in memory by file and block number.
+  A file is known by its device, inode, size and mtime, so blocks of a
+  file that has changed in lower are never found again and just age
+  out.  Eviction is CLOCK: a hit sets a slot's reference bit, and the
+  hand clears bits until it finds a slot without one.
+
+  The scratch file is unlinked as soon as it's created, so the cache
+  starts empty on every run and never shows up in upper.  Thread-safe;
+  slot contents are read and written outside the lock, with a
+  per-slot generation count to catch a slot being reused under a
+  reader.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#define BLOCKCACHE_BLOCK (1<<18)
+
+class block_cache
+{
+public:
+     std::atomic<unsigned long> hits{0};
+     std::atomic<unsigned long> misses{0};
+
+     /*Create the scratch file in dir_fd and size the cache to hold
+       bytes.  Returns 0 or -errno; without a successful open, reads
+       go straight to the file.*/
+     int open(int dir_fd, unsigned long bytes)
+     {
+          size_t count = bytes/BLOCKCACHE_BLOCK;
+          if(!count)
+               return 0;
+          int fd = openat(dir_fd,".",O_TMPFILE | O_RDWR,0600);
+          if(fd==-1)
+          {
+               const char* name = ".tefs-blocks";
+               fd = openat(dir_fd,name,O_RDWR | O_CREAT | O_EXCL,0600);
+               if(fd==-1)
+                    return -errno;
+               unlinkat(dir_fd,name,0);
+          }
+          slots.resize(count);
+          slab = fd;
+          return 0;
+     }
+
+     bool enabled() const
+     {
+          return slab!=-1;
+     }
+
+     //Number for the file as st describes it; 0 if caching is off.
+     uint64_t file_id(const struct stat& st)
+     {
+          if(!enabled() || !S_ISREG(st.st_mode))
+               return 0;
+          auto key = std::make_tuple(st.st_dev,st.st_ino,st.st_size,st.st_mtim.tv_sec,st.st_mtim.tv_nsec);
+          pthread_mutex_lock(&lock);
+          //Ids of files nobody reads any more only cost memory; their
+          //blocks are evicted like any other.
+          if(ids.size() > slots.size())
+               ids.clear();
+          auto it = ids.emplace(key,next_id).first;
+          if(it->second==next_id)
+               next_id++;
+          uint64_t to_return = it->second;
+          pthread_mutex_unlock(&lock);
+          return to_return;
+     }
+
+     //pread() from fd, which is the file id stands for, going through
+     //the cache.
+     ssize_t read(uint64_t id, int fd, char* buf, size_t size, off_t offset)
+     {
+          if(!id)
+               return pread(fd,buf,size,offset);
+
+          size_t done = 0;
+          std::vector<char> block;
+          while(done<size)
+          {
+               off_t pos = offset+done;
+               uint64_t number = pos/BLOCKCACHE_BLOCK;
+               size_t skip = pos%BLOCKCACHE_BLOCK;
+               size_t want = std::min<size_t>(size-done,BLOCKCACHE_BLOCK-skip);
+
+               ssize_t got = read_cached(id,number,buf+done,skip,want);
+               if(got<0)
+               {
+                    misses++;
+                    block.resize(BLOCKCACHE_BLOCK);
+                    ssize_t len = pread(fd,block.data(),BLOCKCACHE_BLOCK,(off_t)number*BLOCKCACHE_BLOCK);
+                    if(len==-1)
+                         return done ? (ssize_t)done : -1;
+                    insert(id,number,block.data(),len);
+                    got = len>(ssize_t)skip ? std::min<size_t>(want,len-skip) : 0;
+                    memcpy(buf+done,block.data()+skip,got);
+               }
+               else
+                    hits++;
+
+               done += got;
+               if(got<(ssize_t)want)
+                    break;
+          }
+          return done;
+     }
+
+private:
+     struct block_key
+     {
+          uint64_t id;
+          uint64_t number;
+          bool operator==(const block_key& other) const
+          {
+               return id==other.id && number==other.number;
+          }
+     };
+
+     struct block_hash
+     {
+          size_t operator()(const block_key& key) const
+          {
+               return key.id*0x9E3779B97F4A7C15ull ^ key.number;
+          }
+     };
+
+     struct slot
+     {
+          block_key key;
+          size_t length = 0;
+          uint64_t generation = 0;
+          bool used = false;
+          bool referenced = false;
+          bool filling = false;   //handed out by victim, being written
+     };
+
+     /*Copy want bytes from skip into the cached block into buf.
+       Returns the number of bytes copied, which is short at the end of
+       the file, or -1 on a miss.*/
+     ssize_t read_cached(uint64_t id, uint64_t number, char* buf, size_t skip, size_t want)
+     {
+          pthread_mutex_lock(&lock);
+          auto it = index.find({id,number});
+          if(it==index.end())
+          {
+               pthread_mutex_unlock(&lock);
+               return -1;
+          }
+          size_t s = it->second;
+          slots[s].referenced = true;
+          uint64_t generation = slots[s].generation;
+          size_t length = slots[s].length;
+          pthread_mutex_unlock(&lock);
+
+          size_t len = length>skip ? std::min(want,length-skip) : 0;
+          if(len && pread(slab,buf,len,(off_t)s*BLOCKCACHE_BLOCK+skip)!=(ssize_t)len)
+               return -1;
+
+          pthread_mutex_lock(&lock);
+          bool still_there = slots[s].generation==generation;
+          pthread_mutex_unlock(&lock);
+          return still_there ? (ssize_t)len : -1;
+     }
+
+     void insert(uint64_t id, uint64_t number, const char* data, size_t length)
+     {
+          pthread_mutex_lock(&lock);
+          if(index.count({id,number}))
+          {
+               pthread_mutex_unlock(&lock);
+               return;
+          }
+          size_t s = victim();
+          pthread_mutex_unlock(&lock);
+          if(s==slots.size())
+               return;
+
+          bool written = pwrite(slab,data,length,(off_t)s*BLOCKCACHE_BLOCK)==(ssize_t)length;
+
+          pthread_mutex_lock(&lock);
+          slots[s].filling = false;
+          if(written && !index.count({id,number}))
+          {
+               slots[s].key = {id,number};
+               slots[s].length = length;
+               slots[s].used = true;
+               slots[s].referenced = false;
+               index.emplace(slots[s].key,s);
+          }
+          pthread_mutex_unlock(&lock);
+     }
+
+     /*Empty out a slot for reuse and hand it to the caller, who clears
+       filling when done with it.  Returns slots.size() if every slot
+       is being filled already.  Call with lock held.*/
+     size_t victim()
+     {
+          for(size_t tries = 0; tries < 2*slots.size(); tries++)
+          {
+               size_t s = hand;
+               hand = (hand+1)%slots.size();
+               if(slots[s].filling)
+                    continue;
+               if(slots[s].referenced)
+               {
+                    slots[s].referenced = false;
+                    continue;
+               }
+               if(slots[s].used)
+                    index.erase(slots[s].key);
+               slots[s].used = false;
+               slots[s].filling = true;
+               slots[s].generation++;
+               return s;
+          }
+          return slots.size();
+     }
+
+     pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+     int slab = -1;
+     std::vector<slot> slots;
+     size_t hand = 0;
+     std::unordered_map<block_key,size_t,block_hash> index;
+     std::map<std::tuple<dev_t,ino_t,off_t,time_t,long>,uint64_t> ids;
+     uint64_t next_id = 1;
+};
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef CHUNKMAP_H
+#define CHUNKMAP_H
+
+/*Which chunks of a lazily copied-up file have arrived in upper.
+
+  A big file is copied up as a sparse file of the right size, and its
+  chunks are filled in from lower as they are needed, or in the
+  background.  This bitmap says which ones are there; it is kept in an
+  extended attribute on the upper file so a restart can pick up where
+  the last run left off.  Chunks past the end of the file as it was in
+  lower count as present: there is nothing in lower to fetch for them.
+
+  Not thread-safe.
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include <cstddef>
+#include <vector>
+
+#define CHUNKMAP_XATTR "user.tefs.chunks"
+#define CHUNKMAP_CHUNK (1<<20)
+
+class chunk_map
+{
+public:
+     explicit chunk_map(off_t size = 0)
+          : bytes(size), count((size+CHUNKMAP_CHUNK-1)/CHUNKMAP_CHUNK),
+            absent(count), bits((count+63)/64)
+     {
+     }
+
+     //Size of the lower file the chunks come from.
+     off_t size() const
+     {
+          return bytes;
+     }
+
+     size_t chunks() const
+     {
+          return count;
+     }
+
+     size_t missing() const
+     {
+          return absent;
+     }
+
+     bool has(size_t chunk) const
+     {
+          return chunk>=count || (bits[chunk/64] >> (chunk%64) & 1);
+     }
+
+     void set(size_t chunk)
+     {
+          if(has(chunk))
+               return;
+          bits[chunk/64] |= (uint64_t)1 << (chunk%64);
+          absent--;
+     }
+
+     //chunk and everything after it.
+     void set_from(size_t chunk)
+     {
+          for(; chunk<count; chunk++)
+               set(chunk);
+     }
+
+     //First absent chunk at or after from, or chunks() if there is none.
+     size_t next_missing(size_t from) const
+     {
+          for(; from<count; from++)
+          {
+               if(!(from%64) && bits[from/64]==~(uint64_t)0)
+               {
+                    from += 63;
+                    continue;
+               }
+               if(!has(from))
+                    return from;
+          }
+          return count;
+     }
+
+     //Write the bitmap to fd's xattr.  Returns 0 or -errno.
+     int save(int fd) const
+     {
+          std::vector<uint64_t> value;
+          value.reserve(bits.size()+1);
+          value.push_back(bytes);
+          value.insert(value.end(),bits.begin(),bits.end());
+          if(fsetxattr(fd,CHUNKMAP_XATTR,value.data(),value.size()*sizeof(uint64_t),0)==-1)
+               return -errno;
+          return 0;
+     }
+
+     //Read the bitmap back.  Returns 0, or -errno (ENODATA if fd isn't
+     //a partial file).
+     int load(int fd)
+     {
+          ssize_t len = fgetxattr(fd,CHUNKMAP_XATTR,NULL,0);
+          if(len<0)
+               return -errno;
+          std::vector<uint64_t> value(len/sizeof(uint64_t));
+          if(value.empty() || fgetxattr(fd,CHUNKMAP_XATTR,value.data(),value.size()*sizeof(uint64_t))<0)
+               return -EINVAL;
+
+          *this = chunk_map(value[0]);
+          if(value.size()-1 != bits.size())
+               return -EINVAL;
+          for(size_t i=0; i<count; i++)
+               if(value[1+i/64] >> (i%64) & 1)
+                    set(i);
+          return 0;
+     }
+
+     //Is fd a file that is still being filled in?
+     static bool marked(int fd)
+     {
+          return fgetxattr(fd,CHUNKMAP_XATTR,NULL,0)>=0;
+     }
+
+     static bool marked_path(const char* path)
+     {
+          return lgetxattr(path,CHUNKMAP_XATTR,NULL,0)>=0;
+     }
+
+     static int unmark(int fd)
+     {
+          if(fremovexattr(fd,CHUNKMAP_XATTR)==-1 && errno!=ENODATA)
+               return -errno;
+          return 0;
+     }
+
+private:
+     off_t bytes;
+     size_t count;
+     size_t absent;
+     std::vector<uint64_t> bits;
+};
+
+#endif
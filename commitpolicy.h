@@ -0,0 +1,162 @@
+#ifndef COMMITPOLICY_H
+#define COMMITPOLICY_H
+
+//Per-path commit delays, read from a policy file.
+//
+//One rule per line, first match wins; blank lines and lines starting
+//with # are ignored.  A rule is a pattern followed by any of
+//
+//  delay=N      commit N seconds after the last change
+//  max=N        but no later than N seconds after the first one
+//  never        don't commit at all; the file stays in upper only
+//  size<N       only for files smaller than N bytes
+//  size>N       only for files bigger than N bytes
+//
+//Sizes can end in k, M or G.  A pattern with a / in it is matched
+//against the whole path (starting with /), otherwise against the last
+//component, with fnmatch; * matches across slashes in whole-path
+//patterns, so /tmp/* and /tmp/** both mean everything under /tmp.
+//For example
+//
+//  /tmp/**          never
+//  *.log            delay=300
+//  *                size<4k delay=1
+//
+//Anything a rule doesn't set comes from the defaults passed in.
+//Not thread-safe to load; match is, once loaded.
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+class commit_policy
+{
+public:
+     struct rule
+     {
+          std::string pattern;
+          bool whole_path = false;
+          off_t min_size = 0;
+          off_t max_size = std::numeric_limits<off_t>::max();
+          time_t delay = 60;
+          time_t max_delay = 600;
+          bool never = false;
+     };
+
+     //What applies when no rule matches.
+     void set_defaults(time_t delay, time_t max_delay)
+     {
+          fallback.delay = delay;
+          fallback.max_delay = max_delay;
+     }
+
+     /*Read rules from file.  Returns 0 or -errno; a line that can't be
+       parsed is -EINVAL, with its number in bad_line.*/
+     int load(const std::string& file, unsigned& bad_line)
+     {
+          FILE* in = fopen(file.c_str(),"r");
+          if(!in)
+               return -errno;
+          char* line = NULL;
+          size_t len = 0;
+          unsigned number = 0;
+          int res = 0;
+          while(!res && getline(&line,&len,in)!=-1)
+          {
+               number++;
+               std::istringstream tokens(line);
+               std::string token;
+               if(!(tokens >> token) || token[0]=='#')
+                    continue;
+               rule r = fallback;
+               r.pattern = token;
+               r.whole_path = token.find('/')!=std::string::npos;
+               while(!res && tokens >> token)
+                    if(token=="never")
+                         r.never = true;
+                    else if(!token.compare(0,6,"delay="))
+                         res = number_of(token.substr(6),r.delay);
+                    else if(!token.compare(0,4,"max="))
+                         res = number_of(token.substr(4),r.max_delay);
+                    else if(!token.compare(0,5,"size<"))
+                         res = size_of(token.substr(5),r.max_size);
+                    else if(!token.compare(0,5,"size>"))
+                    {
+                         res = size_of(token.substr(5),r.min_size);
+                         r.min_size++;
+                    }
+                    else
+                         res = -EINVAL;
+               if(!res && (r.min_size || r.max_size!=std::numeric_limits<off_t>::max()))
+                    sized = true;
+               if(res)
+                    bad_line = number;
+               else
+                    rules.push_back(r);
+          }
+          free(line);
+          fclose(in);
+          return res;
+     }
+
+     //Whether match needs to know sizes.
+     bool uses_size() const
+     {
+          return sized;
+     }
+
+     //The rule for path, size bytes long (ignored unless uses_size).
+     const rule& match(const std::string& path, off_t size = 0) const
+     {
+          std::string base = path.substr(path.rfind('/')+1);
+          for(const auto& r : rules)
+               if(!fnmatch(r.pattern.c_str(),(r.whole_path ? path : base).c_str(),0) &&
+                  size>=r.min_size && size<r.max_size)
+                    return r;
+          return fallback;
+     }
+
+private:
+     static int number_of(const std::string& text, time_t& out)
+     {
+          char* end;
+          long value = strtol(text.c_str(),&end,10);
+          if(text.empty() || *end || value<0)
+               return -EINVAL;
+          out = value;
+          return 0;
+     }
+
+     static int size_of(const std::string& text, off_t& out)
+     {
+          char* end;
+          long long value = strtoll(text.c_str(),&end,10);
+          if(text.empty() || end==text.c_str() || value<0)
+               return -EINVAL;
+          std::string suffix = end;
+          if(suffix=="k" || suffix=="K")
+               value <<= 10;
+          else if(suffix=="M")
+               value <<= 20;
+          else if(suffix=="G")
+               value <<= 30;
+          else if(suffix.size())
+               return -EINVAL;
+          out = value;
+          return 0;
+     }
+
+     std::vector<rule> rules;
+     rule fallback;
+     bool sized = false;
+};
+
+#endif
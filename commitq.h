@@ -0,0 +1,226 @@
+#ifndef COMMITQ_H
+#define COMMITQ_H
+
+/*Queue of pending copies between the layers.
+
+  Entries are indexed by path in an ordered map, which points into a
+  multimap ordered by deadline, so queueing, requeueing and cancelling
+  a path don't have to walk the whole queue, and neither does renaming
+  a directory.  Most deadlines are "now
+  plus a constant", which lands at the back of the multimap, so the
+  insertion is hinted there and is amortized constant time.
+
+  Not thread-safe: terminusestfs keeps these under pending_commits_lock.
+*/
+
+#include <sys/types.h>
+#include <time.h>
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+class commit_queue
+{
+public:
+     //Queue path to be copied at due, replacing any earlier entry.
+     void push(const std::string& path, time_t due)
+     {
+          auto it = by_path.find(path);
+          if(it==by_path.end())
+               it = by_path.emplace(path,by_deadline.end()).first;
+          else
+               by_deadline.erase(it->second);
+          it->second = insert(due,&it->first);
+     }
+
+     //Queue path unless it's already queued.  Returns whether it was.
+     bool push_if_absent(const std::string& path, time_t due)
+     {
+          auto res = by_path.emplace(path,by_deadline.end());
+          if(!res.second)
+               return false;
+          res.first->second = insert(due,&res.first->first);
+          return true;
+     }
+
+     //Drop path from the queue.  Returns whether it was queued.
+     bool cancel(const std::string& path)
+     {
+          auto it = by_path.find(path);
+          if(it==by_path.end())
+               return false;
+          by_deadline.erase(it->second);
+          by_path.erase(it);
+          return true;
+     }
+
+     bool contains(const std::string& path) const
+     {
+          return by_path.count(path);
+     }
+
+     size_t size() const
+     {
+          return by_path.size();
+     }
+
+     bool empty() const
+     {
+          return by_path.empty();
+     }
+
+     //Deadline of the earliest entry; only valid when not empty.
+     time_t next_due() const
+     {
+          return by_deadline.begin()->first;
+     }
+
+     /*Remove and return the earliest entry due by now for which skip
+       returns false.  Entries that are skipped stay where they are.*/
+     template<typename Predicate>
+     bool pop_due(time_t now, Predicate skip, std::string& path, time_t& due)
+     {
+          for(auto it = by_deadline.begin(); it!=by_deadline.end() && it->first<=now; ++it)
+          {
+               if(skip(*it->second))
+                    continue;
+               path = *it->second;
+               due = it->first;
+               cancel(path);
+               return true;
+          }
+          return false;
+     }
+
+     /*Remove up to max more entries due by now that take returns true
+       for, earliest first, adding their paths to paths.  Only the
+       first scan due entries are looked at, so a long backlog doesn't
+       make every call walk all of it.*/
+     template<typename Predicate>
+     size_t pop_due_matching(time_t now, Predicate take, size_t max, size_t scan, std::vector<std::string>& paths)
+     {
+          size_t taken = 0;
+          for(auto it = by_deadline.begin(); taken<max && scan && it!=by_deadline.end() && it->first<=now; scan--)
+          {
+               auto next = std::next(it);
+               if(take(*it->second))
+               {
+                    paths.push_back(*it->second);
+                    cancel(paths.back());
+                    taken++;
+               }
+               it = next;
+          }
+          return taken;
+     }
+
+     //Move everything at or under from to the same place under to.
+     void rename(const std::string& from, const std::string& to)
+     {
+          std::map<std::string,time_t> moved;
+          auto it = by_path.find(from);
+          if(it!=by_path.end())
+          {
+               moved.emplace(to,it->second->first);
+               by_deadline.erase(it->second);
+               by_path.erase(it);
+          }
+          //Everything under from sorts together, straight after from+"/".
+          std::string fdir = from+"/";
+          for(it = by_path.lower_bound(fdir); it!=by_path.end() && !it->first.compare(0,fdir.length(),fdir);)
+          {
+               moved.emplace(to+it->first.substr(from.length()),it->second->first);
+               by_deadline.erase(it->second);
+               it = by_path.erase(it);
+          }
+          for(const auto& x : moved)
+               push(x.first,x.second);
+     }
+
+     template<typename Function>
+     void for_each(Function f) const
+     {
+          for(const auto& x : by_deadline)
+               f(*x.second,x.first);
+     }
+
+private:
+     typedef std::multimap<time_t,const std::string*> deadline_map;
+
+     deadline_map::iterator insert(time_t due, const std::string* path)
+     {
+          if(by_deadline.empty() || due>=by_deadline.rbegin()->first)
+               return by_deadline.emplace_hint(by_deadline.end(),due,path);
+          return by_deadline.emplace(due,path);
+     }
+
+     //The multimap points at the path map's keys, which stay put.
+     deadline_map by_deadline;
+     std::map<std::string,deadline_map::iterator> by_path;
+};
+
+/*Byte ranges of a file that have changed since its last commit, kept
+  merged so there are never two overlapping or touching extents.*/
+class dirty_extents
+{
+public:
+     typedef std::map<off_t,off_t>::const_iterator iterator;
+
+     //[start,end) changed.
+     void add(off_t start, off_t end)
+     {
+          if(start>=end)
+               return;
+          auto it = extents.upper_bound(start);
+          if(it!=extents.begin())
+          {
+               auto prev = std::prev(it);
+               if(prev->second >= start)
+               {
+                    start = prev->first;
+                    end = std::max(end,prev->second);
+                    it = extents.erase(prev);
+               }
+          }
+          while(it!=extents.end() && it->first <= end)
+          {
+               end = std::max(end,it->second);
+               it = extents.erase(it);
+          }
+          extents.emplace(start,end);
+     }
+
+     void merge(const dirty_extents& other)
+     {
+          for(const auto& x : other.extents)
+               add(x.first,x.second);
+     }
+
+     void clear()
+     {
+          extents.clear();
+     }
+
+     bool empty() const
+     {
+          return extents.empty();
+     }
+
+     iterator begin() const
+     {
+          return extents.begin();
+     }
+
+     iterator end() const
+     {
+          return extents.end();
+     }
+
+private:
+     std::map<off_t,off_t> extents;
+};
+
+#endif
@@ -0,0 +1,466 @@
+#ifndef COPYLIB_H
+#define COPYLIB_H
+
+/*In-process replacement for "mkdir -p" and "cp -a".
+
+  Everything here works relative to a pair of layer root directory
+  descriptors, and takes paths the way FUSE hands them to us ("/a/b").
+  Errors are returned as negative errno values, like the tefs_*
+  operations.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+//Turn a FUSE path into something usable with the *at() calls.
+static inline std::string copylib_relative(const std::string& path)
+{
+     size_t start = path.find_first_not_of('/');
+     if(start==std::string::npos)
+          return ".";
+     return path.substr(start);
+}
+
+static inline std::string copylib_parent(const std::string& path)
+{
+     size_t slash = path.rfind('/');
+     if(slash==std::string::npos)
+          return "";
+     return path.substr(0,slash);
+}
+
+/*Create every missing directory of dir under dst_root, taking mode
+  and ownership from the same directory under src_root when it exists
+  there.*/
+static inline int copylib_mkdirs(int src_root, int dst_root, const std::string& dir)
+{
+     std::string rel = copylib_relative(dir);
+     if(rel==".")
+          return 0;
+
+     size_t pos = 0;
+     while(pos!=std::string::npos)
+     {
+          pos = rel.find('/',pos+1);
+          std::string prefix = rel.substr(0,pos);
+          if(prefix.empty() || prefix.back()=='/')
+               continue;
+
+          struct stat st;
+          bool have_source = !fstatat(src_root,prefix.c_str(),&st,AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+          if(mkdirat(dst_root,prefix.c_str(),have_source ? (st.st_mode & 07777) : 0755)==-1)
+          {
+               if(errno!=EEXIST)
+                    return -errno;
+               continue;
+          }
+          if(have_source)
+          {
+               fchownat(dst_root,prefix.c_str(),st.st_uid,st.st_gid,AT_SYMLINK_NOFOLLOW);
+               fchmodat(dst_root,prefix.c_str(),st.st_mode & 07777,0);
+          }
+     }
+
+     return 0;
+}
+
+//Prefix of the extended attributes terminusestfs keeps for itself.
+//They describe one layer's copy, so they are never copied.
+#define COPYLIB_PRIVATE_XATTRS "user.tefs."
+
+//Copy extended attributes, ignoring the ones the target filesystem
+//won't take, which is what cp -a does too.
+static inline void copylib_copy_xattrs(int in, int out)
+{
+     ssize_t len = flistxattr(in,NULL,0);
+     if(len<=0)
+          return;
+     std::vector<char> names(len);
+     len = flistxattr(in,names.data(),names.size());
+     if(len<=0)
+          return;
+
+     std::vector<char> value;
+     for(ssize_t i=0; i<len; i+=strlen(&names[i])+1)
+     {
+          const char* name = &names[i];
+          if(!strncmp(name,COPYLIB_PRIVATE_XATTRS,strlen(COPYLIB_PRIVATE_XATTRS)))
+               continue;
+          ssize_t vlen = fgetxattr(in,name,NULL,0);
+          if(vlen<0)
+               continue;
+          value.resize(vlen);
+          vlen = fgetxattr(in,name,value.data(),value.size());
+          if(vlen<0)
+               continue;
+          fsetxattr(out,name,value.data(),vlen,0);
+     }
+}
+
+//Owner, mode, xattrs and times, in the order that keeps setuid bits
+//and timestamps from being clobbered by the later steps.
+static inline void copylib_copy_attrs(int in, int out, const struct stat& st)
+{
+     fchown(out,st.st_uid,st.st_gid);
+     fchmod(out,st.st_mode & 07777);
+     copylib_copy_xattrs(in,out);
+     struct timespec times[2] = {st.st_atim, st.st_mtim};
+     futimens(out,times);
+}
+
+//Copy [offset,offset+len) of in to the same place in out.
+static inline int copylib_copy_range(int in, int out, off_t offset, off_t len)
+{
+     static std::atomic<bool> no_copy_file_range{false};
+     static std::atomic<bool> no_sendfile{false};
+
+     while(len>0)
+     {
+          ssize_t res = -1;
+          if(!no_copy_file_range)
+          {
+               loff_t ioff = offset, ooff = offset;
+               res = copy_file_range(in,&ioff,out,&ooff,len,0);
+               if(res==-1 && (errno==ENOSYS || errno==EXDEV || errno==EOPNOTSUPP || errno==EINVAL))
+               {
+                    if(errno==ENOSYS)
+                         no_copy_file_range = true;
+                    res = -2;
+               }
+          }
+          else
+               res = -2;
+
+          if(res==-2 && !no_sendfile)
+          {
+               off_t ioff = offset;
+               if(lseek(out,offset,SEEK_SET)==-1)
+                    return -errno;
+               res = sendfile(out,in,&ioff,len);
+               if(res==-1 && (errno==ENOSYS || errno==EINVAL))
+               {
+                    if(errno==ENOSYS)
+                         no_sendfile = true;
+                    res = -2;
+               }
+          }
+
+          if(res==-2)
+          {
+               char buf[1<<16];
+               res = pread(in,buf,len < (off_t)sizeof(buf) ? len : sizeof(buf),offset);
+               if(res>0)
+                    res = pwrite(out,buf,res,offset);
+          }
+
+          if(res==-1)
+          {
+               if(errno==EINTR)
+                    continue;
+               return -errno;
+          }
+          if(res==0)
+               break;
+
+          offset += res;
+          len -= res;
+     }
+
+     return 0;
+}
+
+/*Copy the contents of in to out: a reflink if the filesystem can do
+  it, otherwise only the data extents, so sparse files stay sparse.*/
+static inline int copylib_copy_data(int in, int out, off_t size)
+{
+     if(!ioctl(out,FICLONE,in))
+          return 0;
+
+     off_t offset = 0;
+     while(offset<size)
+     {
+          off_t data = lseek(in,offset,SEEK_DATA);
+          if(data==-1)
+          {
+               if(errno==ENXIO)
+                    break;
+               //No SEEK_DATA support; copy everything that's left.
+               int res = copylib_copy_range(in,out,offset,size-offset);
+               if(res<0)
+                    return res;
+               break;
+          }
+          off_t hole = lseek(in,data,SEEK_HOLE);
+          if(hole==-1)
+               hole = size;
+
+          int res = copylib_copy_range(in,out,data,hole-data);
+          if(res<0)
+               return res;
+          offset = hole;
+     }
+
+     if(ftruncate(out,size)==-1)
+          return -errno;
+     return 0;
+}
+
+//Name for the scratch file a copy is written to before being renamed
+//over the destination.
+static inline std::string copylib_temp_name(const std::string& rel)
+{
+     static std::atomic<unsigned long> counter{0};
+     std::string dir = copylib_parent(rel);
+     std::string base = rel.substr(dir.empty() ? 0 : dir.length()+1);
+     std::string temp = ".tefs-copy."+std::to_string(getpid())+"."+std::to_string(counter++)+"."+base;
+     return dir.empty() ? temp : dir+"/"+temp;
+}
+
+static inline int copylib_copy_tree(int src_root, int dst_root, const std::string& rel, bool durable = false);
+
+//Make the entries of dir under root durable.
+static inline int copylib_sync_dir(int root, const std::string& dir)
+{
+     int fd = openat(root,dir.empty() ? "." : dir.c_str(),O_RDONLY | O_DIRECTORY);
+     if(fd==-1)
+          return -errno;
+     int res = fsync(fd)==-1 ? -errno : 0;
+     close(fd);
+     return res;
+}
+
+/*With durable set, the copies below are on disk before they return:
+  the data before it is renamed into place, and the directory entry
+  after.*/
+static inline int copylib_copy_file(int src_root, int dst_root, const std::string& rel, const struct stat& st,
+                                    bool durable = false)
+{
+     int in = openat(src_root,rel.c_str(),O_RDONLY | O_NOFOLLOW);
+     if(in==-1)
+          return -errno;
+
+     std::string temp = copylib_temp_name(rel);
+     int out = openat(dst_root,temp.c_str(),O_WRONLY | O_CREAT | O_EXCL,0600);
+     if(out==-1)
+     {
+          int res = -errno;
+          close(in);
+          return res;
+     }
+
+     int res = copylib_copy_data(in,out,st.st_size);
+     if(!res)
+     {
+          copylib_copy_attrs(in,out,st);
+          if(durable && fsync(out)==-1)
+               res = -errno;
+     }
+     if(!res && renameat(dst_root,temp.c_str(),dst_root,rel.c_str())==-1)
+          res = -errno;
+     if(res)
+          unlinkat(dst_root,temp.c_str(),0);
+     else if(durable)
+          res = copylib_sync_dir(dst_root,copylib_parent(rel));
+
+     close(out);
+     close(in);
+     return res;
+}
+
+static inline int copylib_copy_symlink(int src_root, int dst_root, const std::string& rel, const struct stat& st,
+                                       bool durable = false)
+{
+     std::vector<char> target(st.st_size+1);
+     ssize_t len = readlinkat(src_root,rel.c_str(),target.data(),target.size());
+     if(len==-1)
+          return -errno;
+     target[len] = '\0';
+
+     std::string temp = copylib_temp_name(rel);
+     if(symlinkat(target.data(),dst_root,temp.c_str())==-1)
+          return -errno;
+     fchownat(dst_root,temp.c_str(),st.st_uid,st.st_gid,AT_SYMLINK_NOFOLLOW);
+     struct timespec times[2] = {st.st_atim, st.st_mtim};
+     utimensat(dst_root,temp.c_str(),times,AT_SYMLINK_NOFOLLOW);
+     if(renameat(dst_root,temp.c_str(),dst_root,rel.c_str())==-1)
+     {
+          int res = -errno;
+          unlinkat(dst_root,temp.c_str(),0);
+          return res;
+     }
+     return durable ? copylib_sync_dir(dst_root,copylib_parent(rel)) : 0;
+}
+
+static inline int copylib_copy_dir(int src_root, int dst_root, const std::string& rel, const struct stat& st,
+                                   bool durable = false)
+{
+     if(mkdirat(dst_root,rel.c_str(),0700)==-1 && errno!=EEXIST)
+          return -errno;
+
+     int dfd = openat(src_root,rel.c_str(),O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+     if(dfd==-1)
+          return -errno;
+     DIR* dp = fdopendir(dfd);
+     if(!dp)
+     {
+          int res = -errno;
+          close(dfd);
+          return res;
+     }
+
+     int res = 0;
+     struct dirent* de;
+     while(!res && (de = readdir(dp))!=NULL)
+     {
+          if(!strcmp(de->d_name,".") || !strcmp(de->d_name,".."))
+               continue;
+          res = copylib_copy_tree(src_root,dst_root,rel+"/"+de->d_name,durable);
+     }
+     closedir(dp);
+     if(res)
+          return res;
+
+     int out = openat(dst_root,rel.c_str(),O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+     int in = openat(src_root,rel.c_str(),O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+     if(out!=-1 && in!=-1)
+          copylib_copy_attrs(in,out,st);
+     if(durable && out!=-1 && fsync(out)==-1)
+          res = -errno;
+     if(out!=-1)
+          close(out);
+     if(in!=-1)
+          close(in);
+     if(!res && durable)
+          res = copylib_sync_dir(dst_root,copylib_parent(rel));
+     return res;
+}
+
+static inline int copylib_copy_tree(int src_root, int dst_root, const std::string& rel, bool durable)
+{
+     struct stat st;
+     if(fstatat(src_root,rel.c_str(),&st,AT_SYMLINK_NOFOLLOW)==-1)
+          return -errno;
+
+     if(S_ISREG(st.st_mode))
+          return copylib_copy_file(src_root,dst_root,rel,st,durable);
+     if(S_ISLNK(st.st_mode))
+          return copylib_copy_symlink(src_root,dst_root,rel,st,durable);
+     if(S_ISDIR(st.st_mode))
+          return copylib_copy_dir(src_root,dst_root,rel,st,durable);
+
+     unlinkat(dst_root,rel.c_str(),0);
+     if(mknodat(dst_root,rel.c_str(),st.st_mode,st.st_rdev)==-1)
+          return -errno;
+     fchownat(dst_root,rel.c_str(),st.st_uid,st.st_gid,AT_SYMLINK_NOFOLLOW);
+     struct timespec times[2] = {st.st_atim, st.st_mtim};
+     utimensat(dst_root,rel.c_str(),times,AT_SYMLINK_NOFOLLOW);
+     return durable ? copylib_sync_dir(dst_root,copylib_parent(rel)) : 0;
+}
+
+/*Bring an existing copy of a regular file up to date by copying only
+  the given extents, then matching the source's size and attributes.
+  Extents is anything iterable as (start, end) pairs.  The copy is
+  updated in place, and with durable set is on disk before this
+  returns.*/
+template<typename Extents>
+static inline int copylib_copy_extents(int src_root, int dst_root, const std::string& path, const Extents& extents,
+                                       bool durable = false)
+{
+     std::string rel = copylib_relative(path);
+     int in = openat(src_root,rel.c_str(),O_RDONLY | O_NOFOLLOW);
+     if(in==-1)
+          return -errno;
+     int out = openat(dst_root,rel.c_str(),O_WRONLY | O_NOFOLLOW);
+     if(out==-1)
+     {
+          int res = -errno;
+          close(in);
+          return res;
+     }
+
+     struct stat st;
+     int res = fstat(in,&st)==-1 ? -errno : 0;
+     for(auto it = extents.begin(); !res && it!=extents.end(); ++it)
+     {
+          off_t start = it->first, end = std::min<off_t>(it->second,st.st_size);
+          if(start<end)
+               res = copylib_copy_range(in,out,start,end-start);
+     }
+     if(!res && ftruncate(out,st.st_size)==-1)
+          res = -errno;
+     if(!res)
+          copylib_copy_attrs(in,out,st);
+     if(!res && durable && fsync(out)==-1)
+          res = -errno;
+
+     close(out);
+     close(in);
+     return res;
+}
+
+/*Copy the files names, all in directory dir, the way copylib_copy
+  copies each: but with the directory opened once in each layer and
+  everything looked up from there, and with one fsync of the
+  destination directory at the end, so the renames into place last.
+  dir must already exist in dst_root.  results gets 0 or -errno for
+  each name, and dst_st what its copy looks like.  Returns -errno if
+  the directories couldn't be opened, else 0.*/
+static inline int copylib_copy_batch(int src_root, int dst_root, const std::string& dir,
+                                     const std::vector<std::string>& names,
+                                     std::vector<int>& results, std::vector<struct stat>& dst_st)
+{
+     std::string rel = copylib_relative(dir);
+     int src_dir = openat(src_root,rel.c_str(),O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+     if(src_dir==-1)
+          return -errno;
+     int dst_dir = openat(dst_root,rel.c_str(),O_RDONLY | O_DIRECTORY);
+     if(dst_dir==-1)
+     {
+          int res = -errno;
+          close(src_dir);
+          return res;
+     }
+
+     results.assign(names.size(),0);
+     dst_st.resize(names.size());
+     for(size_t i=0; i<names.size(); i++)
+     {
+          results[i] = copylib_copy_tree(src_dir,dst_dir,names[i]);
+          if(!results[i] && fstatat(dst_dir,names[i].c_str(),&dst_st[i],AT_SYMLINK_NOFOLLOW)==-1)
+               results[i] = -errno;
+     }
+     int res = fsync(dst_dir)==-1 ? -errno : 0;
+     for(auto& x : results)
+          if(!x)
+               x = res;
+
+     close(dst_dir);
+     close(src_dir);
+     return 0;
+}
+
+/*The equivalent of "cp -a src_root/path dst_root/path": the parent
+  directory must already exist in dst_root.  Files and symlinks are
+  written to a scratch name and renamed into place, so nobody ever sees
+  a half-copied file.  With durable set, the copy is on disk, name and
+  all, before this returns.*/
+static inline int copylib_copy(int src_root, int dst_root, const std::string& path, bool durable = false)
+{
+     return copylib_copy_tree(src_root,dst_root,copylib_relative(path),durable);
+}
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+/*Merged directory listings, remembered so listing a directory again
+  doesn't read both layers again.
+
+  A listing is the names in a directory, in the order they were
+  returned, each with its type.  They're shared and never changed once
+  stored; anything that changes a directory just drops its listing.
+  Listings that took long enough to read that the directory may have
+  changed meanwhile are caught with a generation count: take one with
+  generation() before reading, and set() ignores the listing if
+  anything was dropped since.
+
+  Bounded by the total number of names held, least recently used
+  listings going first.  Listings can carry an expiry time, like
+  layer_cache entries.  Thread-safe.
+*/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class dir_cache
+{
+public:
+     struct entry
+     {
+          std::string name;
+          unsigned char type;   //DT_*
+     };
+     typedef std::vector<entry> listing;
+
+     std::atomic<unsigned long> hits{0};
+     std::atomic<unsigned long> misses{0};
+
+     void set_capacity(size_t names)
+     {
+          pthread_mutex_lock(&lock);
+          capacity = names;
+          shrink();
+          pthread_mutex_unlock(&lock);
+     }
+
+     size_t get_capacity()
+     {
+          pthread_mutex_lock(&lock);
+          size_t to_return = capacity;
+          pthread_mutex_unlock(&lock);
+          return to_return;
+     }
+
+     std::shared_ptr<const listing> lookup(const std::string& path)
+     {
+          std::shared_ptr<const listing> to_return;
+          pthread_mutex_lock(&lock);
+          auto it = dirs.find(path);
+          if(it!=dirs.end() && it->second.expires && it->second.expires <= time(NULL))
+          {
+               drop(it);
+               it = dirs.end();
+          }
+          if(it!=dirs.end())
+          {
+               to_return = it->second.names;
+               lru.splice(lru.begin(),lru,it->second.position);
+          }
+          pthread_mutex_unlock(&lock);
+
+          if(to_return)
+               hits++;
+          else
+               misses++;
+          return to_return;
+     }
+
+     uint64_t generation()
+     {
+          pthread_mutex_lock(&lock);
+          uint64_t to_return = current;
+          pthread_mutex_unlock(&lock);
+          return to_return;
+     }
+
+     /*Remember path's listing, read starting at generation
+       read_since.  ttl is in seconds, 0 for no expiry.*/
+     void set(const std::string& path, std::shared_ptr<const listing> names, uint64_t read_since, time_t ttl = 0)
+     {
+          pthread_mutex_lock(&lock);
+          if(read_since==current && names->size() <= capacity)
+          {
+               auto it = dirs.find(path);
+               if(it!=dirs.end())
+                    drop(it);
+               it = dirs.emplace(path,cached()).first;
+               lru.push_front(&it->first);
+               it->second.names = names;
+               it->second.expires = ttl ? time(NULL)+ttl : 0;
+               it->second.position = lru.begin();
+               held += names->size();
+               shrink();
+          }
+          pthread_mutex_unlock(&lock);
+     }
+
+     //Forget the listing of path, which has had a name added or removed.
+     void erase(const std::string& path)
+     {
+          pthread_mutex_lock(&lock);
+          current++;
+          auto it = dirs.find(path);
+          if(it!=dirs.end())
+               drop(it);
+          pthread_mutex_unlock(&lock);
+     }
+
+     //Forget path and everything under it.
+     void erase_tree(const std::string& path)
+     {
+          std::string dir = path=="/" ? path : path+"/";
+          pthread_mutex_lock(&lock);
+          current++;
+          auto it = dirs.find(path);
+          if(it!=dirs.end())
+               drop(it);
+          //Everything under path sorts together, straight after dir.
+          for(it = dirs.lower_bound(dir); it!=dirs.end() && !it->first.compare(0,dir.length(),dir);)
+               it = drop(it);
+          pthread_mutex_unlock(&lock);
+     }
+
+private:
+     struct cached
+     {
+          std::shared_ptr<const listing> names;
+          time_t expires;
+          std::list<const std::string*>::iterator position;
+     };
+
+     std::map<std::string,cached>::iterator drop(std::map<std::string,cached>::iterator it)
+     {
+          held -= it->second.names->size();
+          lru.erase(it->second.position);
+          return dirs.erase(it);
+     }
+
+     void shrink()
+     {
+          while(held > capacity && lru.size())
+               drop(dirs.find(*lru.back()));
+     }
+
+     pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+     size_t capacity = 0;
+     size_t held = 0;
+     uint64_t current = 0;
+     //Most recently used first; points at the keys of dirs.
+     std::list<const std::string*> lru;
+     //Ordered, so erase_tree doesn't have to look at every listing.
+     std::map<std::string,cached> dirs;
+};
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+/*Content fingerprints, to tell whether a file rewritten in upper still
+  holds the bytes lower already has.
+
+  XXH3 when xxhash.h is there at build time (inlined, so there is
+  nothing to link), otherwise XXH64, written out here: four
+  independent lanes over 32-byte stripes, which the compiler keeps in
+  registers and can vectorize, merged and mixed at the end.  Either way
+  it runs at memory speed.  A saved fingerprint is tagged with its
+  algorithm, so one saved by a build using the other is just not
+  recognised.
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#if __has_include(<xxhash.h>)
+#define XXH_INLINE_ALL
+#include <xxhash.h>
+#define FINGERPRINT_XXH3 1
+#endif
+
+#ifdef FINGERPRINT_XXH3
+
+class fingerprinter
+{
+public:
+     static const char* algorithm()
+     {
+          return "xxh3";
+     }
+
+     fingerprinter()
+     {
+          XXH3_64bits_reset(&state);
+     }
+
+     void update(const void* data, size_t len)
+     {
+          XXH3_64bits_update(&state,data,len);
+     }
+
+     uint64_t digest() const
+     {
+          return XXH3_64bits_digest(&state);
+     }
+
+private:
+     XXH3_state_t state;
+};
+
+#else
+
+class fingerprinter
+{
+public:
+     static const char* algorithm()
+     {
+          return "xxh64";
+     }
+
+     void update(const void* data, size_t len)
+     {
+          auto p = (const unsigned char*) data;
+          total += len;
+          if(held)
+          {
+               size_t n = std::min(len,sizeof(pending)-held);
+               memcpy(pending+held,p,n);
+               held += n;
+               p += n;
+               len -= n;
+               if(held<sizeof(pending))
+                    return;
+               stripe(pending);
+               held = 0;
+          }
+          for(; len>=sizeof(pending); p += sizeof(pending), len -= sizeof(pending))
+               stripe(p);
+          memcpy(pending,p,len);
+          held = len;
+     }
+
+     uint64_t digest() const
+     {
+          uint64_t h;
+          if(total>=sizeof(pending))
+          {
+               h = rotl(acc[0],1)+rotl(acc[1],7)+rotl(acc[2],12)+rotl(acc[3],18);
+               for(auto x : acc)
+                    h = (h ^ round(0,x))*P1+P4;
+          }
+          else
+               h = P5;
+          h += total;
+
+          size_t i = 0;
+          for(; i+8<=held; i += 8)
+               h = rotl(h ^ round(0,load64(pending+i)),27)*P1+P4;
+          for(; i+4<=held; i += 4)
+          {
+               uint32_t word;
+               memcpy(&word,pending+i,4);
+               h = rotl(h ^ (word*P1),23)*P2+P3;
+          }
+          for(; i<held; i++)
+               h = rotl(h ^ (pending[i]*P5),11)*P1;
+
+          h ^= h >> 33;
+          h *= P2;
+          h ^= h >> 29;
+          h *= P3;
+          h ^= h >> 32;
+          return h;
+     }
+
+private:
+     static const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+     static const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+     static const uint64_t P3 = 0x165667B19E3779F9ULL;
+     static const uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+     static const uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+     static uint64_t rotl(uint64_t x, int bits)
+     {
+          return (x << bits) | (x >> (64-bits));
+     }
+
+     static uint64_t round(uint64_t acc, uint64_t lane)
+     {
+          return rotl(acc+lane*P2,31)*P1;
+     }
+
+     static uint64_t load64(const unsigned char* p)
+     {
+          uint64_t x;
+          memcpy(&x,p,8);
+          return x;
+     }
+
+     void stripe(const unsigned char* p)
+     {
+          for(int i=0; i<4; i++)
+               acc[i] = round(acc[i],load64(p+8*i));
+     }
+
+     uint64_t acc[4] = {P1+P2, P2, 0, 0-P1};
+     unsigned char pending[32];
+     size_t held = 0;
+     uint64_t total = 0;
+};
+
+#endif
+
+//Fingerprint everything in fd.  Returns 0 or -errno.
+static inline int fingerprint_fd(int fd, uint64_t& hash)
+{
+     fingerprinter f;
+     std::vector<char> buf(1<<20);
+     off_t offset = 0;
+     ssize_t len;
+     while((len = pread(fd,buf.data(),buf.size(),offset))>0)
+     {
+          f.update(buf.data(),len);
+          offset += len;
+     }
+     if(len==-1)
+          return -errno;
+     hash = f.digest();
+     return 0;
+}
+
+#endif
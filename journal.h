@@ -0,0 +1,290 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/*Append-only record of changes to the commit queues, so a restart
+  after a crash knows which files still have to go to lower without
+  comparing the whole of upper against it.
+
+  One record per line: a type letter, then one or two paths separated
+  by tabs, with backslashes, tabs and newlines in paths escaped.  The
+  types are up to the user; terminusestfs uses
+
+    E path       commit queued
+    C path       commit done
+    L path       lower-to-upper copy queued
+    D path       lower-to-upper copy done
+    X path       both cancelled
+    R from to    everything at or under from moved to to
+
+  Appends are buffered by the kernel and made durable by sync().
+  Compaction replaces the journal with just the records a callback
+  writes, so it doesn't grow forever: start_compact() takes the
+  records, which is quick, and finish_compact() makes them durable and
+  swaps them in, carrying over whatever was appended meanwhile.
+  Thread-safe.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <string>
+
+class commit_journal
+{
+public:
+     //Open (creating) name in dir_fd for appending.  Returns 0 or -errno.
+     int open(int dir_fd, const std::string& name)
+     {
+          dir = dir_fd;
+          file = name;
+          fd = openat(dir,file.c_str(),O_WRONLY | O_APPEND | O_CREAT,0600);
+          return fd==-1 ? -errno : 0;
+     }
+
+     void append(char type, const std::string& path, const std::string& other = "")
+     {
+          std::string record = format(type,path,other);
+          pthread_mutex_lock(&lock);
+          if(fd!=-1 && write(fd,record.data(),record.size())==(ssize_t)record.size())
+          {
+               records++;
+               dirty = true;
+               if(compacting!=-1)
+               {
+                    tail += record;
+                    tail_records++;
+               }
+          }
+          pthread_mutex_unlock(&lock);
+     }
+
+     int sync()
+     {
+          pthread_mutex_lock(&lock);
+          int res = 0;
+          if(fd!=-1 && dirty)
+               res = fdatasync(fd)==-1 ? -errno : 0;
+          if(!res)
+          {
+               //The compacted journal has to keep this promise too.
+               if(dirty && compacting!=-1)
+                    tail_synced = true;
+               dirty = false;
+          }
+          //A compacted journal isn't there for sure until its rename is.
+          if(!res && renamed)
+               res = fsync(dir)==-1 ? -errno : 0;
+          if(!res)
+               renamed = false;
+          pthread_mutex_unlock(&lock);
+          return res;
+     }
+
+     //Records appended since the journal was opened or last compacted.
+     size_t size()
+     {
+          pthread_mutex_lock(&lock);
+          size_t to_return = records;
+          pthread_mutex_unlock(&lock);
+          return to_return;
+     }
+
+     /*Start rewriting the journal as whatever live writes, which is
+       called with a function taking (type, path, other).  live must
+       not call append, and has to see the queues as of one moment, so
+       call this where nothing appends; it only writes to the kernel's
+       buffers.  Returns 0, -EBUSY if a compaction is under way
+       already, or -errno.*/
+     template<typename Function>
+     int start_compact(Function live)
+     {
+          pthread_mutex_lock(&lock);
+          if(compacting!=-1)
+          {
+               pthread_mutex_unlock(&lock);
+               return -EBUSY;
+          }
+          int res = 0;
+          std::string temp = file+".new";
+          if((compacting = openat(dir,temp.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0600))==-1)
+               res = -errno;
+          size_t count = 0;
+          std::string buf;
+          auto emit = [&](char type, const std::string& path, const std::string& other)
+               {
+                    buf += format(type,path,other);
+                    count++;
+                    if(buf.size() >= 1<<16)
+                         flush(compacting,buf,res);
+               };
+          if(!res)
+               live(emit);
+          flush(compacting,buf,res);
+          if(res && compacting!=-1)
+               abandon();
+          compacted = count;
+          tail.clear();
+          tail_records = 0;
+          tail_synced = false;
+          pthread_mutex_unlock(&lock);
+          return res;
+     }
+
+     /*Finish what start_compact began: make the new journal durable,
+       add what was appended since, and put it in place.  Appends can
+       go on meanwhile.  Returns 0 or -errno.*/
+     int finish_compact()
+     {
+          pthread_mutex_lock(&lock);
+          int out = compacting;
+          pthread_mutex_unlock(&lock);
+          if(out==-1)
+               return 0;
+          int res = fdatasync(out)==-1 ? -errno : 0;
+
+          pthread_mutex_lock(&lock);
+          std::string temp = file+".new";
+          bool synced = tail_synced;
+          flush(out,tail,res);
+          //Only what someone has synced already has to be durable now;
+          //the rest is dirty in the new journal, as it was in the old.
+          if(!res && synced && fdatasync(out)==-1)
+               res = -errno;
+          //Keep appending to the new file.
+          if(!res && fcntl(out,F_SETFL,O_APPEND)==-1)
+               res = -errno;
+          if(!res && renameat(dir,temp.c_str(),dir,file.c_str())==-1)
+               res = -errno;
+          if(res)
+               abandon();
+          else
+          {
+               close(fd);
+               fd = out;
+               compacting = -1;
+               records = compacted+tail_records;
+               renamed = true;
+          }
+          pthread_mutex_unlock(&lock);
+          return res ? res : sync();
+     }
+
+     /*Call f(type, path, other) for every record in name in dir_fd, in
+       order.  A torn record at the end, from a crash in the middle of
+       an append, is ignored.  Returns the number of records, or -errno
+       (-ENOENT if there is no journal).*/
+     template<typename Function>
+     static long replay(int dir_fd, const std::string& name, Function f)
+     {
+          int in = openat(dir_fd,name.c_str(),O_RDONLY);
+          if(in==-1)
+               return -errno;
+          std::string data;
+          char buf[1<<16];
+          ssize_t len;
+          while((len = read(in,buf,sizeof(buf)))>0)
+               data.append(buf,len);
+          close(in);
+          if(len==-1)
+               return -errno;
+
+          long count = 0;
+          size_t start = 0, end;
+          while((end = data.find('\n',start))!=std::string::npos)
+          {
+               std::string line = data.substr(start,end-start);
+               start = end+1;
+               size_t tab = line.find('\t');
+               if(line.empty() || tab!=1)
+                    continue;
+               size_t tab2 = line.find('\t',2);
+               std::string path = unescape(line.substr(2,tab2==std::string::npos ? std::string::npos : tab2-2));
+               std::string other = tab2==std::string::npos ? "" : unescape(line.substr(tab2+1));
+               f(line[0],path,other);
+               count++;
+          }
+          return count;
+     }
+
+private:
+     static std::string escape(const std::string& path)
+     {
+          std::string to_return;
+          for(char c : path)
+               if(c=='\\')
+                    to_return += "\\\\";
+               else if(c=='\t')
+                    to_return += "\\t";
+               else if(c=='\n')
+                    to_return += "\\n";
+               else
+                    to_return += c;
+          return to_return;
+     }
+
+     static std::string unescape(const std::string& field)
+     {
+          std::string to_return;
+          for(size_t i=0; i<field.size(); i++)
+               if(field[i]=='\\' && i+1<field.size())
+               {
+                    i++;
+                    to_return += field[i]=='t' ? '\t' : field[i]=='n' ? '\n' : field[i];
+               }
+               else
+                    to_return += field[i];
+          return to_return;
+     }
+
+     static std::string format(char type, const std::string& path, const std::string& other)
+     {
+          std::string record(1,type);
+          record += '\t';
+          record += escape(path);
+          if(other.size())
+          {
+               record += '\t';
+               record += escape(other);
+          }
+          record += '\n';
+          return record;
+     }
+
+     //Give up on a compaction.  Call with lock held.
+     void abandon()
+     {
+          close(compacting);
+          unlinkat(dir,(file+".new").c_str(),0);
+          compacting = -1;
+     }
+
+     static void flush(int out, std::string& buf, int& res)
+     {
+          if(!res && buf.size() && write(out,buf.data(),buf.size())!=(ssize_t)buf.size())
+               res = errno ? -errno : -EIO;
+          buf.clear();
+     }
+
+     pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+     int dir = -1;
+     int fd = -1;
+     std::string file;
+     size_t records = 0;
+     bool dirty = false;
+     //The new journal while compacting, or -1, and what it will hold.
+     int compacting = -1;
+     size_t compacted = 0;
+     //Appended since compaction started, for the new journal too, and
+     //whether any of it has been synced.
+     std::string tail;
+     size_t tail_records = 0;
+     bool tail_synced = false;
+     //The journal was just replaced, and dir has to be synced to be
+     //sure it stays replaced.
+     bool renamed = false;
+};
+
+#endif
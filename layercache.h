@@ -0,0 +1,148 @@
+#ifndef LAYERCACHE_H
+#define LAYERCACHE_H
+
+/*Which layer a path lives in, remembered so resolving it doesn't cost
+  a faccessat on each layer every time.
+
+  Bounded: once there are more than capacity entries, the least
+  recently used ones go.  Entries can carry an expiry time, after
+  which they count as missing.  Thread-safe.
+*/
+
+#include <pthread.h>
+#include <time.h>
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <string>
+
+class layer_cache
+{
+public:
+     enum layer { ABSENT, UPPER, LOWER };
+
+     std::atomic<unsigned long> hits{0};
+     std::atomic<unsigned long> misses{0};
+
+     void set_capacity(size_t entries)
+     {
+          pthread_mutex_lock(&lock);
+          capacity = entries;
+          shrink();
+          pthread_mutex_unlock(&lock);
+     }
+
+     bool lookup(const std::string& path, layer& where)
+     {
+          pthread_mutex_lock(&lock);
+          auto it = entries.find(path);
+          bool found = it!=entries.end();
+          if(found && it->second.expires && it->second.expires <= time(NULL))
+          {
+               lru.erase(it->second.position);
+               entries.erase(it);
+               found = false;
+          }
+          if(found)
+          {
+               where = it->second.where;
+               lru.splice(lru.begin(),lru,it->second.position);
+          }
+          pthread_mutex_unlock(&lock);
+
+          if(found)
+               hits++;
+          else
+               misses++;
+          return found;
+     }
+
+     //Remember where path is.  ttl is in seconds, 0 for no expiry.
+     void set(const std::string& path, layer where, time_t ttl = 0)
+     {
+          if(!capacity)
+               return;
+          pthread_mutex_lock(&lock);
+          auto it = entries.find(path);
+          if(it==entries.end())
+          {
+               it = entries.emplace(path,entry()).first;
+               lru.push_front(&it->first);
+          }
+          else
+               lru.splice(lru.begin(),lru,it->second.position);
+          it->second.where = where;
+          it->second.expires = ttl ? time(NULL)+ttl : 0;
+          it->second.position = lru.begin();
+          shrink();
+          pthread_mutex_unlock(&lock);
+     }
+
+     void erase(const std::string& path)
+     {
+          pthread_mutex_lock(&lock);
+          auto it = entries.find(path);
+          if(it!=entries.end())
+          {
+               lru.erase(it->second.position);
+               entries.erase(it);
+          }
+          pthread_mutex_unlock(&lock);
+     }
+
+     //Forget path and everything under it.
+     void erase_tree(const std::string& path)
+     {
+          std::string dir = path+"/";
+          pthread_mutex_lock(&lock);
+          auto it = entries.find(path);
+          if(it!=entries.end())
+          {
+               lru.erase(it->second.position);
+               entries.erase(it);
+          }
+          //Everything under path sorts together, straight after dir.
+          for(it = entries.lower_bound(dir); it!=entries.end() && !it->first.compare(0,dir.length(),dir);)
+          {
+               lru.erase(it->second.position);
+               it = entries.erase(it);
+          }
+          pthread_mutex_unlock(&lock);
+     }
+
+     size_t size()
+     {
+          pthread_mutex_lock(&lock);
+          size_t to_return = entries.size();
+          pthread_mutex_unlock(&lock);
+          return to_return;
+     }
+
+private:
+     struct entry
+     {
+          layer where;
+          time_t expires;
+          std::list<const std::string*>::iterator position;
+     };
+
+     void shrink()
+     {
+          while(entries.size() > capacity)
+          {
+               auto victim = entries.find(*lru.back());
+               lru.pop_back();
+               entries.erase(victim);
+          }
+     }
+
+     pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+     size_t capacity = 0;
+     //Most recently used first; points at the keys of entries.
+     std::list<const std::string*> lru;
+     //Ordered, so erase_tree doesn't have to look at every entry.
+     std::map<std::string,entry> entries;
+};
+
+#endif
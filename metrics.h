@@ -0,0 +1,166 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/*Counters and latency histograms, cheap enough to keep on every
+  request.
+
+  Each thread counts into a slab of its own, so recording something is
+  a couple of plain stores: no locked instructions, and no cache lines
+  passed between threads.  Reading adds up every slab, plus what
+  threads that have since exited left behind, so a reading is only
+  roughly consistent across values.
+
+  Operations and counters are named when the metrics are made and are
+  referred to by their index from then on.  A histogram has a bucket
+  for each power of two microseconds.
+*/
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+class metrics
+{
+public:
+     static const unsigned BUCKETS = 32;  //the last one is everything from 2^31us on
+
+     struct histogram
+     {
+          uint64_t count = 0;
+          uint64_t total_us = 0;
+          uint64_t buckets[BUCKETS] = {};
+
+          //Upper bound of the bucket the p'th fraction of samples fall in.
+          uint64_t percentile_us(double p) const
+          {
+               uint64_t seen = 0;
+               for(unsigned i=0; i<BUCKETS; i++)
+               {
+                    seen += buckets[i];
+                    if(seen && seen >= p*count)
+                         return (uint64_t)1<<(i+1);
+               }
+               return 0;
+          }
+     };
+
+     struct reading
+     {
+          std::vector<histogram> ops;
+          std::vector<uint64_t> counters;
+     };
+
+     const std::vector<std::string> op_names;
+     const std::vector<std::string> counter_names;
+
+     metrics(std::vector<std::string> ops, std::vector<std::string> counters)
+          : op_names(ops), counter_names(counters), retired(slab_size())
+     {
+     }
+
+     //op took this many seconds.
+     void record(unsigned op, double seconds)
+     {
+          uint64_t us = seconds>0 ? seconds*1000000 : 0;
+          unsigned bucket = 0;
+          while(bucket<BUCKETS-1 && us >> (bucket+1))
+               bucket++;
+          auto& values = mine()->values;
+          size_t base = op*(BUCKETS+2);
+          bump(values[base],1);
+          bump(values[base+1],us);
+          bump(values[base+2+bucket],1);
+     }
+
+     void count(unsigned counter, uint64_t n = 1)
+     {
+          bump(mine()->values[op_names.size()*(BUCKETS+2)+counter],n);
+     }
+
+     reading read()
+     {
+          std::vector<uint64_t> sum;
+          pthread_mutex_lock(&lock);
+          sum = retired;
+          for(auto s : slabs)
+               for(size_t i=0; i<sum.size(); i++)
+                    sum[i] += s->values[i].load(std::memory_order_relaxed);
+          pthread_mutex_unlock(&lock);
+
+          reading to_return;
+          to_return.ops.resize(op_names.size());
+          for(size_t op=0; op<op_names.size(); op++)
+          {
+               size_t base = op*(BUCKETS+2);
+               to_return.ops[op].count = sum[base];
+               to_return.ops[op].total_us = sum[base+1];
+               std::copy(&sum[base+2],&sum[base+2+BUCKETS],to_return.ops[op].buckets);
+          }
+          to_return.counters.assign(sum.begin()+op_names.size()*(BUCKETS+2),sum.end());
+          return to_return;
+     }
+
+private:
+     struct slab
+     {
+          explicit slab(size_t size) : values(size) {}
+          std::vector<std::atomic<uint64_t>> values;
+     };
+
+     //A thread's slabs, handed back to their metrics when it exits.
+     struct owned
+     {
+          std::vector<std::pair<metrics*,slab*>> slabs;
+          ~owned()
+          {
+               for(auto& x : slabs)
+                    x.first->retire(x.second);
+          }
+     };
+
+     //Only ever written by the thread the slab belongs to.
+     static void bump(std::atomic<uint64_t>& value, uint64_t n)
+     {
+          value.store(value.load(std::memory_order_relaxed)+n,std::memory_order_relaxed);
+     }
+
+     size_t slab_size() const
+     {
+          return op_names.size()*(BUCKETS+2)+counter_names.size();
+     }
+
+     slab* mine()
+     {
+          static thread_local owned here;
+          for(auto& x : here.slabs)
+               if(x.first==this)
+                    return x.second;
+          auto s = new slab(slab_size());
+          pthread_mutex_lock(&lock);
+          slabs.push_back(s);
+          pthread_mutex_unlock(&lock);
+          here.slabs.emplace_back(this,s);
+          return s;
+     }
+
+     void retire(slab* s)
+     {
+          pthread_mutex_lock(&lock);
+          for(size_t i=0; i<retired.size(); i++)
+               retired[i] += s->values[i].load(std::memory_order_relaxed);
+          slabs.erase(std::find(slabs.begin(),slabs.end(),s));
+          pthread_mutex_unlock(&lock);
+          delete s;
+     }
+
+     pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+     std::vector<slab*> slabs;
+     std::vector<uint64_t> retired;
+};
+
+#endif
@@ -51,4 +51,203 @@ static inline void plocklib_resign_as_writer(plocklib_rw_lock* lock)
      pthread_rwlock_unlock(lock);
 }
 
+#ifdef __cplusplus
+
+#include <map>
+#include <string>
+#include <unordered_map>
+
+/*Hierarchical path locks.
+
+  A path is locked in one of the usual four modes.  Locking it also
+  takes the matching intent mode on every ancestor (IS for IS and S, IX
+  for IX and X), so an exclusive lock on a directory excludes everything
+  underneath it, while paths in unrelated subtrees only ever share
+  intent locks.  The root is never locked exclusively, so it is left
+  out of the ancestors.
+
+  Entries are kept in stripes picked by hashing the path.  Each stripe
+  has its own mutex and condition variable, and releasing a lock wakes
+  only the waiters in its stripe.
+
+  To stay deadlock-free, take all the locks an operation needs in one
+  call, either one path or a plocklib_path_set, and release them before
+  locking anything else.  Locks are taken in path order, so ancestors
+  come before descendants.  Waiting exclusive requests hold back new
+  ones of the other modes, so exclusive lockers aren't starved.
+*/
+enum plocklib_mode { PLOCKLIB_IS, PLOCKLIB_IX, PLOCKLIB_S, PLOCKLIB_X };
+
+struct plocklib_path_entry
+{
+     unsigned held[4];
+     unsigned waiting;
+     unsigned x_waiting;
+};
+
+const static int PLOCKLIB_STRIPES = 256;
+
+struct plocklib_stripe
+{
+     pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+     pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+     std::unordered_map<std::string,plocklib_path_entry> entries;
+};
+
+struct plocklib_path_table
+{
+     plocklib_stripe stripes[PLOCKLIB_STRIPES];
+};
+
+typedef std::map<std::string,plocklib_mode> plocklib_path_set;
+
+static inline plocklib_stripe& plocklib_stripe_of(plocklib_path_table* table, const std::string& path)
+{
+     return table->stripes[std::hash<std::string>()(path) % PLOCKLIB_STRIPES];
+}
+
+static inline int plocklib_compatible(const plocklib_path_entry& entry, plocklib_mode mode)
+{
+     static const int compatible[4][4] = {
+          /*         IS IX  S  X */
+          /* IS */ { 1, 1, 1, 0 },
+          /* IX */ { 1, 1, 0, 0 },
+          /*  S */ { 1, 0, 1, 0 },
+          /*  X */ { 0, 0, 0, 0 }
+     };
+     for(int held=0; held<4; held++)
+          if(entry.held[held] && !compatible[mode][held])
+               return 0;
+     return 1;
+}
+
+static inline plocklib_mode plocklib_intent(plocklib_mode mode)
+{
+     return mode==PLOCKLIB_IS || mode==PLOCKLIB_S ? PLOCKLIB_IS : PLOCKLIB_IX;
+}
+
+//Lock just this entry; no ancestors.
+static inline void plocklib_lock_entry(plocklib_path_table* table, const std::string& path, plocklib_mode mode)
+{
+     plocklib_stripe& stripe = plocklib_stripe_of(table,path);
+     pthread_mutex_lock(&stripe.lock);
+     plocklib_path_entry& entry = stripe.entries[path];
+     if(!plocklib_compatible(entry,mode) || (mode!=PLOCKLIB_X && entry.x_waiting))
+     {
+          entry.waiting++;
+          if(mode==PLOCKLIB_X)
+               entry.x_waiting++;
+          while(!plocklib_compatible(entry,mode) || (mode!=PLOCKLIB_X && entry.x_waiting))
+               pthread_cond_wait(&stripe.cond,&stripe.lock);
+          if(mode==PLOCKLIB_X)
+               entry.x_waiting--;
+          entry.waiting--;
+     }
+     entry.held[mode]++;
+     pthread_mutex_unlock(&stripe.lock);
+}
+
+static inline void plocklib_unlock_entry(plocklib_path_table* table, const std::string& path, plocklib_mode mode)
+{
+     plocklib_stripe& stripe = plocklib_stripe_of(table,path);
+     pthread_mutex_lock(&stripe.lock);
+     auto it = stripe.entries.find(path);
+     plocklib_path_entry& entry = it->second;
+     entry.held[mode]--;
+     if(!entry.held[0] && !entry.held[1] && !entry.held[2] && !entry.held[3] && !entry.waiting)
+          stripe.entries.erase(it);
+     pthread_cond_broadcast(&stripe.cond);
+     pthread_mutex_unlock(&stripe.lock);
+}
+
+//Trade a held lock for a weaker one without letting go of it.
+static inline void plocklib_downgrade_entry(plocklib_path_table* table, const std::string& path,
+                                            plocklib_mode from, plocklib_mode to)
+{
+     plocklib_stripe& stripe = plocklib_stripe_of(table,path);
+     pthread_mutex_lock(&stripe.lock);
+     plocklib_path_entry& entry = stripe.entries[path];
+     entry.held[from]--;
+     entry.held[to]++;
+     pthread_cond_broadcast(&stripe.cond);
+     pthread_mutex_unlock(&stripe.lock);
+}
+
+//Is path held in this mode by anyone?
+static inline int plocklib_path_held(plocklib_path_table* table, const std::string& path, plocklib_mode mode)
+{
+     plocklib_stripe& stripe = plocklib_stripe_of(table,path);
+     pthread_mutex_lock(&stripe.lock);
+     auto it = stripe.entries.find(path);
+     int held = it!=stripe.entries.end() && it->second.held[mode];
+     pthread_mutex_unlock(&stripe.lock);
+     return held;
+}
+
+//Call f on each ancestor of path, root excluded, outermost first.
+template<typename Function>
+static inline void plocklib_for_each_ancestor(const std::string& path, Function f)
+{
+     for(size_t slash = path.find('/',1); slash!=std::string::npos; slash = path.find('/',slash+1))
+          f(path.substr(0,slash));
+}
+
+static inline void plocklib_lock_path(plocklib_path_table* table, const std::string& path, plocklib_mode mode)
+{
+     plocklib_mode intent = plocklib_intent(mode);
+     plocklib_for_each_ancestor(path,[&](const std::string& x) { plocklib_lock_entry(table,x,intent); });
+     plocklib_lock_entry(table,path,mode);
+}
+
+static inline void plocklib_unlock_path(plocklib_path_table* table, const std::string& path, plocklib_mode mode)
+{
+     plocklib_mode intent = plocklib_intent(mode);
+     plocklib_unlock_entry(table,path,mode);
+     plocklib_for_each_ancestor(path,[&](const std::string& x) { plocklib_unlock_entry(table,x,intent); });
+}
+
+/*Weaken a lock taken with plocklib_lock_path, ancestors included.
+  to must be no stronger than from.*/
+static inline void plocklib_downgrade_path(plocklib_path_table* table, const std::string& path,
+                                           plocklib_mode from, plocklib_mode to)
+{
+     plocklib_mode from_intent = plocklib_intent(from), to_intent = plocklib_intent(to);
+     plocklib_downgrade_entry(table,path,from,to);
+     if(from_intent!=to_intent)
+          plocklib_for_each_ancestor(path,[&](const std::string& x)
+                                     {
+                                          plocklib_downgrade_entry(table,x,from_intent,to_intent);
+                                     });
+}
+
+//Add path and its ancestors to set, combining with what's there.
+static inline void plocklib_path_set_add(plocklib_path_set& set, const std::string& path, plocklib_mode mode)
+{
+     auto add = [&](const std::string& x, plocklib_mode m)
+          {
+               auto it = set.find(x);
+               if(it==set.end())
+                    set.emplace(x,m);
+               else if(it->second!=m && m!=PLOCKLIB_IS && it->second!=PLOCKLIB_X)
+                    it->second = it->second==PLOCKLIB_IS ? m : PLOCKLIB_X;
+          };
+     plocklib_mode intent = plocklib_intent(mode);
+     plocklib_for_each_ancestor(path,[&](const std::string& x) { add(x,intent); });
+     add(path,mode);
+}
+
+static inline void plocklib_lock_paths(plocklib_path_table* table, const plocklib_path_set& set)
+{
+     for(const auto& x : set)
+          plocklib_lock_entry(table,x.first,x.second);
+}
+
+static inline void plocklib_unlock_paths(plocklib_path_table* table, const plocklib_path_set& set)
+{
+     for(auto it = set.rbegin(); it!=set.rend(); ++it)
+          plocklib_unlock_entry(table,it->first,it->second);
+}
+
+#endif
+
 #endif
@@ -0,0 +1,254 @@
+#ifndef RECONCILE_H
+#define RECONCILE_H
+
+/*Parallel comparison of upper against lower, to find the files a
+  commit has to be redone for when there is no journal to say so.
+
+  A pool of threads walks upper a directory at a time.  Each directory
+  is read with getdents64 and its entries stat'd with fstatat against
+  the directory's descriptor in both layers, so no path is looked up
+  from the root more than once.  A regular file or symlink differs
+  when lower has no copy, or a copy of another size or an older
+  mtime.  Each directory's differing paths go to found in one batch.
+
+  Directories waiting to be read are kept in a deque per thread.
+  Threads take work from the back of their own deque and steal from
+  the front of the others', so one huge subtree is spread over the
+  whole pool.  Lower is usually the bottleneck, so the thread count is
+  there to keep enough lower requests in flight rather than to match
+  the cores.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+class reconciler
+{
+public:
+     std::atomic<unsigned long> dirs{0};
+     std::atomic<unsigned long> files{0};
+     std::atomic<unsigned long> differing{0};
+     std::atomic<unsigned long> errors{0};
+
+     /*found gets batches of differing paths, from several threads at
+       once.  skip, if given, is asked about every path first; paths
+       it returns true for are left out, and so is everything under
+       them.*/
+     reconciler(int upper_fd, int lower_fd, unsigned threads,
+                std::function<void(const std::vector<std::string>&)> found,
+                std::function<bool(const std::string&)> skip = nullptr)
+          : upper_fd(upper_fd), lower_fd(lower_fd), found(found), skip(skip),
+            queues(threads ? threads : 1)
+     {
+     }
+
+     /*Walk all of upper, calling report every interval seconds (and
+       once at the end) from the calling thread.  Returns once
+       everything has been compared.*/
+     void run(std::function<void()> report, unsigned interval = 5)
+     {
+          queues[0].items.push_back("");
+          outstanding = 1;
+
+          std::vector<pthread_t> threads(queues.size());
+          std::vector<std::pair<reconciler*,size_t>> args(queues.size());
+          for(size_t i=0; i<queues.size(); i++)
+          {
+               args[i] = {this,i};
+               pthread_create(&threads[i],NULL,worker_main,&args[i]);
+          }
+
+          pthread_mutex_lock(&done_lock);
+          while(outstanding)
+          {
+               struct timespec timeout;
+               clock_gettime(CLOCK_REALTIME,&timeout);
+               timeout.tv_sec += interval;
+               if(pthread_cond_timedwait(&done_cond,&done_lock,&timeout)==ETIMEDOUT && outstanding && report)
+               {
+                    pthread_mutex_unlock(&done_lock);
+                    report();
+                    pthread_mutex_lock(&done_lock);
+               }
+          }
+          pthread_mutex_unlock(&done_lock);
+
+          for(auto& x : threads)
+               pthread_join(x,NULL);
+          if(report)
+               report();
+     }
+
+private:
+     struct work_queue
+     {
+          pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+          std::deque<std::string> items;
+     };
+
+     struct linux_dirent64
+     {
+          ino64_t d_ino;
+          off64_t d_off;
+          unsigned short d_reclen;
+          unsigned char d_type;
+          char d_name[];
+     };
+
+     static void* worker_main(void* arg)
+     {
+          auto self = (std::pair<reconciler*,size_t>*) arg;
+          self->first->work(self->second);
+          return NULL;
+     }
+
+     void push(size_t me, const std::string& dir)
+     {
+          outstanding++;
+          pthread_mutex_lock(&queues[me].lock);
+          queues[me].items.push_back(dir);
+          pthread_mutex_unlock(&queues[me].lock);
+     }
+
+     //Our own newest item, or the oldest one of somebody else's.
+     bool take(size_t me, std::string& dir)
+     {
+          for(size_t i=0; i<queues.size(); i++)
+          {
+               size_t victim = (me+i)%queues.size();
+               pthread_mutex_lock(&queues[victim].lock);
+               auto& items = queues[victim].items;
+               bool got = !items.empty();
+               if(got)
+               {
+                    if(!i)
+                    {
+                         dir = std::move(items.back());
+                         items.pop_back();
+                    }
+                    else
+                    {
+                         dir = std::move(items.front());
+                         items.pop_front();
+                    }
+               }
+               pthread_mutex_unlock(&queues[victim].lock);
+               if(got)
+                    return true;
+          }
+          return false;
+     }
+
+     void work(size_t me)
+     {
+          while(outstanding)
+          {
+               std::string dir;
+               if(!take(me,dir))
+               {
+                    usleep(1000);
+                    continue;
+               }
+               scan(me,dir);
+               if(!--outstanding)
+               {
+                    pthread_mutex_lock(&done_lock);
+                    pthread_cond_broadcast(&done_cond);
+                    pthread_mutex_unlock(&done_lock);
+               }
+          }
+     }
+
+     static std::string relative(const std::string& path)
+     {
+          return path.empty() ? "." : path.substr(1);
+     }
+
+     //Compare one directory ("" for the root, else "/a/b").
+     void scan(size_t me, const std::string& dir)
+     {
+          int ufd = openat(upper_fd,relative(dir).c_str(),O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+          if(ufd==-1)
+          {
+               errors++;
+               return;
+          }
+          //No lower directory just means everything in it differs.
+          int lfd = openat(lower_fd,relative(dir).c_str(),O_RDONLY | O_DIRECTORY);
+          dirs++;
+
+          std::vector<std::string> names;
+          std::vector<char> buf(1<<16);
+          long len;
+          while((len = syscall(SYS_getdents64,ufd,buf.data(),buf.size()))>0)
+               for(long pos = 0; pos<len;)
+               {
+                    auto de = (linux_dirent64*)(buf.data()+pos);
+                    pos += de->d_reclen;
+                    if(!strcmp(de->d_name,".") || !strcmp(de->d_name,".."))
+                         continue;
+                    std::string path = dir+"/"+de->d_name;
+                    if(skip && skip(path))
+                         continue;
+                    if(de->d_type==DT_DIR)
+                         push(me,path);
+                    else if(de->d_type==DT_REG || de->d_type==DT_LNK || de->d_type==DT_UNKNOWN)
+                         names.push_back(de->d_name);
+               }
+          if(len<0)
+               errors++;
+
+          std::vector<std::string> differ;
+          for(const auto& name : names)
+          {
+               struct stat ust, lst;
+               if(fstatat(ufd,name.c_str(),&ust,AT_SYMLINK_NOFOLLOW))
+                    continue;
+               if(S_ISDIR(ust.st_mode))
+               {
+                    push(me,dir+"/"+name);
+                    continue;
+               }
+               if(!S_ISREG(ust.st_mode) && !S_ISLNK(ust.st_mode))
+                    continue;
+               files++;
+               if(lfd==-1 || fstatat(lfd,name.c_str(),&lst,AT_SYMLINK_NOFOLLOW) ||
+                  ust.st_size!=lst.st_size || ust.st_mtim.tv_sec > lst.st_mtim.tv_sec ||
+                  (ust.st_mtim.tv_sec==lst.st_mtim.tv_sec && ust.st_mtim.tv_nsec > lst.st_mtim.tv_nsec))
+                    differ.push_back(dir+"/"+name);
+          }
+          if(lfd!=-1)
+               close(lfd);
+          close(ufd);
+
+          if(differ.size())
+          {
+               differing += differ.size();
+               found(differ);
+          }
+     }
+
+     int upper_fd;
+     int lower_fd;
+     std::function<void(const std::vector<std::string>&)> found;
+     std::function<bool(const std::string&)> skip;
+     std::vector<work_queue> queues;
+     std::atomic<unsigned long> outstanding{0};
+     pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+     pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+};
+
+#endif
@@ -6,10 +6,10 @@
   This program can be distributed under the terms of the GNU GPL.
   See the file COPYING.
 
-  gcc -Wall fusexmp.c `pkg-config fuse --cflags --libs` -o fusexmp
+  g++ -Wall -O2 terminusestfs.cpp `pkg-config fuse3 --cflags --libs` -o terminusestfs
 */
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 31
 
 #ifdef HAVE_CONFIG_H
 #include <config.h>
@@ -20,797 +20,4223 @@
 #define _XOPEN_SOURCE 700
 #endif
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
 #include <sys/types.h>
-#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/xattr.h>
 
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
+#include <limits>
 #include <list>
 #include <map>
+#include <memory>
+#include <optional>
 #include <set>
+#include <sstream>
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
+#include "attrq.h"
+#include "blockcache.h"
+#include "chunkmap.h"
+#include "commitpolicy.h"
+#include "commitq.h"
+#include "copylib.h"
+#include "dircache.h"
+#include "fingerprint.h"
+#include "journal.h"
+#include "layercache.h"
+#include "metrics.h"
 #include "plocklib.h"
+#include "reconcile.h"
 
 using namespace std;
 
-const static float SLEEPY_TIME = 0.1;
-const static int DELAY_TIME = 60;
+/*Take path, and everything under it if it's a directory, out of m, a
+  map keyed by path.  What's under path sorts together straight after
+  path+"/", so this costs what it takes out, not the size of m.*/
+template<typename Map>
+static vector<typename Map::node_type> extract_tree(Map& m, const string& path)
+{
+     vector<typename Map::node_type> to_return;
+     auto it = m.find(path);
+     if(it!=m.end())
+          to_return.push_back(m.extract(it));
+     string dir = path+"/";
+     for(it = m.lower_bound(dir); it!=m.end() && !it->first.compare(0,dir.length(),dir);)
+          to_return.push_back(m.extract(it++));
+     return to_return;
+}
+
+//Move path, and everything under it, to the same place under to in m,
+//replacing what's there.
+template<typename Map>
+static void rename_tree(Map& m, const string& from, const string& to)
+{
+     auto moved = extract_tree(m,from);
+     for(auto& x : moved)
+     {
+          x.key() = to+x.key().substr(from.length());
+          m.insert_or_assign(x.key(),move(x.mapped()));
+     }
+}
+
 
 static string upper;
 static string lower;
+static int upper_fd;
+static int lower_fd;
 
-static plocklib_simple_t active_commits_lock = PTHREAD_MUTEX_INITIALIZER;
 static plocklib_simple_t pending_commits_lock = PTHREAD_MUTEX_INITIALIZER;
-static list<pair<string,time_t>> pending_commits;
-static list<pair<string,time_t>> pending_luc; //lower-to-upper copies
+static commit_queue pending_commits;
+static commit_queue pending_luc; //lower-to-upper copies
+//Commits someone is waiting for, taken before anything in
+//pending_commits.  Every path here is in pending_commits too; ones
+//that aren't any more have been committed by the bulk lane already.
+static commit_queue urgent_commits;
+static commit_policy policy;
+static pthread_cond_t commits_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t luc_cond = PTHREAD_COND_INITIALIZER;
+//Changes to attributes made in upper and still to be made in lower
+//(see attrs_thread).  attrs_queued is its size, for looking without
+//the lock.
+static attr_queue attr_changes;
+static atomic<size_t> attrs_queued{0};
+static pthread_cond_t attrs_cond = PTHREAD_COND_INITIALIZER;
+
+//Changes to the queues, for crash recovery (see journal.h).  Records
+//are appended with pending_commits_lock held, so they are in the same
+//order as the changes.  The journal lives in upper/.tefs, which is
+//hidden from the mounted filesystem.
+static commit_journal journal;
+static int state_fd = -1;
+
+//Paths a commit, lower-to-upper copy, attribute change or rename is
+//working on right now, protected by pending_commits_lock.  A path
+//conflicts with itself and with everything above or below it.
+static multiset<string> active_commits;
+static pthread_cond_t active_commits_cond = PTHREAD_COND_INITIALIZER;
+
+/*What a file's lower copy looked like the last time it matched upper,
+  and which parts of upper have been written since.  A commit that
+  finds lower still looking like base only copies the dirty extents.
+  Files with no entry, or with known unset, get a full copy.  Also
+  how long a queued commit may be put off.  Protected by
+  pending_commits_lock.*/
+struct commit_state
+{
+     bool known = false;
+     struct stat base;
+     dirty_extents dirty;
+     time_t delay = 0;        //after each change, from its policy
+     time_t latest = 0;       //but no later than this
+     int error = 0;           //of the last commit, for fsync
+     bool hashed = false;     //fingerprint is of what base holds
+     uint64_t fingerprint = 0;
+     unsigned failures = 0;   //commits in a row that failed
+};
+static map<string,commit_state> commit_states;
+//Commits that kept failing while unmounting, or were waiting on a
+//partial file's chunks, left in the journal for the next mount
+//instead.
+static set<string> unflushed;
+//Attribute changes to paths only in lower that kept failing while
+//unmounting, and so are lost.
+static unsigned long attrs_lost = 0;
+
+//Commit workers back off to a smaller window when lower is slow.
+//Urgent commits don't count against it.
+static unsigned commits_in_flight = 0;
+static unsigned urgent_in_flight = 0;
+static unsigned commit_window;
+//Commits that went through, so the space manager can tell whether
+//anything may have become evictable.
+static atomic<unsigned long> commits_done{0};
+
+//Batched commits so far, for tuning commit_batch.
+static struct
+{
+     atomic<unsigned long> batches{0};
+     atomic<unsigned long> files{0};
+     atomic<unsigned long> bytes{0};
+     atomic<unsigned long> usecs{0};
+} batch_stats;
+
+/*Counters and latency histograms for /.tefs/stats.  Requests are timed
+  in the tefs_ll_* functions; commits and copies up in the threads
+  doing them.*/
+enum
+{
+     OP_LOOKUP, OP_FORGET, OP_GETATTR, OP_SETATTR, OP_READLINK, OP_MKNOD, OP_MKDIR,
+     OP_UNLINK, OP_RMDIR, OP_SYMLINK, OP_RENAME, OP_OPEN, OP_CREATE, OP_READ, OP_WRITE,
+     OP_RELEASE, OP_FSYNC, OP_OPENDIR, OP_READDIR, OP_RELEASEDIR, OP_STATFS, OP_SETXATTR,
+     OP_GETXATTR, OP_LISTXATTR, OP_REMOVEXATTR, OP_ACCESS, OP_FALLOCATE, OP_COMMIT, OP_COPY_UP
+};
+enum
+{
+     BYTES_READ, BYTES_WRITTEN, FILES_COMMITTED, BYTES_COMMITTED, COMMIT_ERRORS,
+     FILES_UNCHANGED, BYTES_SAVED, FILES_COPIED_UP, BYTES_COPIED_UP, ATTRS_COMMITTED, ATTRS_COALESCED,
+     PATH_LOCKS, PATH_LOCK_WAIT_US
+};
+static metrics stats({"lookup", "forget", "getattr", "setattr", "readlink", "mknod", "mkdir",
+                      "unlink", "rmdir", "symlink", "rename", "open", "create", "read", "write",
+                      "release", "fsync", "opendir", "readdir", "releasedir", "statfs", "setxattr",
+                      "getxattr", "listxattr", "removexattr", "access", "fallocate", "commit", "copy_up"},
+                     {"bytes_read", "bytes_written", "files_committed", "bytes_committed", "commit_errors",
+                      "files_unchanged", "bytes_saved", "files_copied_up", "bytes_copied_up", "attrs_committed",
+                      "attrs_coalesced", "path_locks", "path_lock_wait_us"});
+
+static double monotonic_now()
+{
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC,&ts);
+     return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+//Times op from here to the end of the block.
+struct op_timer
+{
+     unsigned op;
+     double started;
+
+     op_timer(unsigned op) : op(op), started(monotonic_now()) {}
+     ~op_timer()
+     {
+          stats.record(op,monotonic_now()-started);
+     }
+};
+
+/*Every operation holds its path in path_locks while it works on it
+  (wuutkl/resign), which puts intent locks on the ancestors.  A path
+  being copied between layers is frozen: locked exclusively, which
+  keeps everyone out of it and, for directories, out of everything
+  under it.
 
-static plocklib_rw_lock frozen_files_lock = PTHREAD_RWLOCK_INITIALIZER;
-static set<string> frozen_files;
+  Locking order:
+  - active_commits claims (lock_commit_paths)
+  - path_locks
+  - pending_commits_lock
+  - open_files_lock
+*/
+static plocklib_path_table path_locks;
 
 static bool two_way;
+static bool durable_lower;  //fsync waits for the commit
+static bool writeback;    //the kernel caches writes; see tefs_ll_init
 static volatile bool flush_time = false;
 
+//Tunables, set with -o name=value.
+static struct tefs_config
+{
+     int two_way;
+     unsigned commit_workers;      //commit worker threads
+     unsigned commit_rate;         //files per second, 0 for no limit
+     unsigned long commit_bandwidth; //bytes per second, 0 for no limit
+     unsigned commit_slow_ms;      //a commit slower than this shrinks the window
+     unsigned commit_batch;        //small files in one directory committed together
+     unsigned long commit_batch_size; //files up to this big count as small
+     unsigned long fingerprint_max; //biggest file fingerprinted, 0 for none
+     int fingerprint_xattr;        //keep fingerprints in upper across mounts
+     unsigned commit_delay;        //seconds from a change to its commit
+     unsigned commit_max_delay;    //seconds a commit can be put off by further changes
+     char* policy;                 //file of per-path delays (see commitpolicy.h)
+     unsigned urgent_workers;      //threads only doing commits someone waits for
+     unsigned attr_workers;        //threads making attribute changes in lower
+     char* durability;             //where fsync makes data durable: upper or lower
+     int commit_on_close;          //commit files right away once closed after writing
+     unsigned layer_cache;         //paths whose layer is remembered
+     unsigned layer_ttl;           //seconds those stay valid in two-way mode
+     unsigned dir_cache;           //directory entries whose listings are remembered
+     unsigned cache_timeout;       //seconds the kernel may keep names and attributes
+     int keep_cache;               //let the kernel keep file pages across opens
+     unsigned max_write;           //largest read or write the kernel sends at once
+     int writeback;                //let the kernel cache writes
+     unsigned long lazy_copy;      //files this big are copied up chunk by chunk
+     unsigned long block_cache;    //bytes of upper used to cache lower blocks
+     unsigned upper_high;          //percent full at which upper files get evicted
+     unsigned upper_low;           //and until which
+     int reconcile;                //compare upper against lower at startup
+     unsigned reconcile_threads;   //threads doing that
+} config = {0, 4, 0, 0, 10000, 64, 65536, 16UL<<20, 0, 60, 600, NULL, 1, 2, NULL, 0, 262144, 5, 262144, 60, 1, 1<<20, 0, 64<<20, 0, 90, 80, 0, 16};
+
+#define TEFS_OPT(t, p) { t, offsetof(struct tefs_config, p), 1 }
+static const struct fuse_opt tefs_opts[] = {
+     TEFS_OPT("two_way", two_way),
+     TEFS_OPT("commit_workers=%u", commit_workers),
+     TEFS_OPT("commit_rate=%u", commit_rate),
+     TEFS_OPT("commit_bandwidth=%lu", commit_bandwidth),
+     TEFS_OPT("commit_slow_ms=%u", commit_slow_ms),
+     TEFS_OPT("commit_batch=%u", commit_batch),
+     TEFS_OPT("commit_batch_size=%lu", commit_batch_size),
+     TEFS_OPT("fingerprint_max=%lu", fingerprint_max),
+     TEFS_OPT("fingerprint_xattr", fingerprint_xattr),
+     TEFS_OPT("commit_delay=%u", commit_delay),
+     TEFS_OPT("commit_max_delay=%u", commit_max_delay),
+     TEFS_OPT("policy=%s", policy),
+     TEFS_OPT("urgent_workers=%u", urgent_workers),
+     TEFS_OPT("attr_workers=%u", attr_workers),
+     TEFS_OPT("durability=%s", durability),
+     TEFS_OPT("commit_on_close", commit_on_close),
+     TEFS_OPT("layer_cache=%u", layer_cache),
+     TEFS_OPT("layer_ttl=%u", layer_ttl),
+     TEFS_OPT("dir_cache=%u", dir_cache),
+     TEFS_OPT("cache_timeout=%u", cache_timeout),
+     { "no_keep_cache", offsetof(struct tefs_config, keep_cache), 0 },
+     TEFS_OPT("max_write=%u", max_write),
+     TEFS_OPT("writeback", writeback),
+     TEFS_OPT("lazy_copy=%lu", lazy_copy),
+     TEFS_OPT("block_cache=%lu", block_cache),
+     TEFS_OPT("upper_high=%u", upper_high),
+     TEFS_OPT("upper_low=%u", upper_low),
+     TEFS_OPT("reconcile", reconcile),
+     TEFS_OPT("reconcile_threads=%u", reconcile_threads),
+     FUSE_OPT_END
+};
+
+//An open file.  fi->fh points at one of these.
+struct open_file
+{
+     int fd;
+     int flags;
+     string path;
+     bool on_upper;
+     uint64_t cache_id;  //the lower file, in blocks; 0 if not cached
+     bool written = false;
+};
+
+static layer_cache layers;
+static dir_cache listings;
+static block_cache blocks;
+
+//Locking order: open_files_lock is taken last.
+static plocklib_simple_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static map<string,set<open_file*>> open_files;
+
 #include <iostream>
 
-static bool exists(string path)
+/*The kernel knows files by node ids, which lookup hands out and forget
+  takes back once the kernel has dropped them.  A node records its
+  parent and name, so its path is a walk up to the root and a rename
+  only touches the node itself.  Everything past the ll_ entry points
+  works on paths.*/
+struct inode
+{
+     fuse_ino_t parent;  //0 once unlinked, or for the root
+     string name;
+     uint64_t nlookup;
+};
+
+static plocklib_simple_t inodes_lock = PTHREAD_MUTEX_INITIALIZER;
+static unordered_map<fuse_ino_t,inode> inodes;
+static map<pair<fuse_ino_t,string>,fuse_ino_t> children;
+static fuse_ino_t next_ino = FUSE_ROOT_ID+1;
+
+//Long, since the kernel is told when something changes behind its
+//back (see invalidate); set from cache_timeout at startup.
+static double entry_timeout = 1.0;
+static double attr_timeout = 1.0;
+
+//Call with inodes_lock held.
+static bool inode_path_locked(fuse_ino_t ino, string& path)
+{
+     path.clear();
+     while(ino!=FUSE_ROOT_ID)
+     {
+          auto it = inodes.find(ino);
+          if(it==inodes.end() || !it->second.parent)
+               return false;
+          path.insert(0,"/"+it->second.name);
+          ino = it->second.parent;
+     }
+     if(path.empty())
+          path = "/";
+     return true;
+}
+
+//Path of node ino; false if it has been unlinked or forgotten.
+static bool inode_path(fuse_ino_t ino, string& path)
+{
+     plocklib_acquire_simple_lock(&inodes_lock);
+     bool to_return = inode_path_locked(ino,path);
+     plocklib_release_simple_lock(&inodes_lock);
+     return to_return;
+}
+
+static bool child_path(fuse_ino_t parent, const char* name, string& path)
+{
+     if(!inode_path(parent,path))
+          return false;
+     if(path.size()>1)
+          path += "/";
+     path += name;
+     return true;
+}
+
+//The kernel is about to learn about name in parent: count the lookup.
+static fuse_ino_t remember_child(fuse_ino_t parent, const char* name)
+{
+     plocklib_acquire_simple_lock(&inodes_lock);
+     auto key = make_pair(parent,string{name});
+     auto it = children.find(key);
+     fuse_ino_t ino;
+     if(it!=children.end())
+          ino = it->second;
+     else
+     {
+          ino = next_ino++;
+          children.emplace(key,ino);
+          inodes[ino] = {parent,name,0};
+     }
+     inodes[ino].nlookup++;
+     plocklib_release_simple_lock(&inodes_lock);
+     return ino;
+}
+
+static void forget_inode(fuse_ino_t ino, uint64_t nlookup)
+{
+     plocklib_acquire_simple_lock(&inodes_lock);
+     auto it = inodes.find(ino);
+     if(it!=inodes.end() && ino!=FUSE_ROOT_ID && (it->second.nlookup -= min(nlookup,it->second.nlookup))==0)
+     {
+          auto child = children.find({it->second.parent,it->second.name});
+          if(child!=children.end() && child->second==ino)
+               children.erase(child);
+          inodes.erase(it);
+     }
+     plocklib_release_simple_lock(&inodes_lock);
+}
+
+//Call with inodes_lock held.
+static void detach_child_locked(fuse_ino_t parent, const string& name)
+{
+     auto it = children.find({parent,name});
+     if(it==children.end())
+          return;
+     inodes[it->second].parent = 0;
+     children.erase(it);
+}
+
+//name in parent is gone; nodes still open keep working by handle.
+static void detach_child(fuse_ino_t parent, const char* name)
+{
+     plocklib_acquire_simple_lock(&inodes_lock);
+     detach_child_locked(parent,name);
+     plocklib_release_simple_lock(&inodes_lock);
+}
+
+static void rename_child(fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname)
+{
+     plocklib_acquire_simple_lock(&inodes_lock);
+     detach_child_locked(newparent,newname);
+     auto it = children.find({parent,name});
+     if(it!=children.end())
+     {
+          fuse_ino_t ino = it->second;
+          children.erase(it);
+          children.emplace(make_pair(newparent,string{newname}),ino);
+          inodes[ino].parent = newparent;
+          inodes[ino].name = newname;
+     }
+     plocklib_release_simple_lock(&inodes_lock);
+}
+
+//Node path is known to the kernel as, and its parent's; false if
+//the kernel doesn't know it.  Call with inodes_lock held.
+static bool path_inode_locked(const string& path, fuse_ino_t& ino, fuse_ino_t& parent)
+{
+     ino = FUSE_ROOT_ID;
+     parent = 0;
+     for(size_t start = 1; start < path.size();)
+     {
+          size_t end = min(path.find('/',start),path.size());
+          auto it = children.find({ino,path.substr(start,end-start)});
+          if(it==children.end())
+               return false;
+          parent = ino;
+          ino = it->second;
+          start = end+1;
+     }
+     return true;
+}
+
+/*Changes the kernel didn't make itself, like copies between the
+  layers and two-way deletions, have to be pushed out of its caches.
+  The notifications can't be sent from a request handler without
+  risking a deadlock on the very inode the request holds, so they're
+  queued and sent by notify_thread.*/
+struct invalidation
+{
+     string path;
+     bool data;     //the contents changed, not just the attributes
+     bool entry;    //the name may not lead to the same thing any more
+};
+
+//Held while notifying, so the session can't go away underneath.
+static plocklib_simple_t session_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fuse_session* session;
+static plocklib_simple_t invalidations_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t invalidations_cond = PTHREAD_COND_INITIALIZER;
+static vector<invalidation> invalidations;
+
+static void invalidate(const string& path, bool data = false, bool entry = false)
+{
+     plocklib_acquire_simple_lock(&invalidations_lock);
+     invalidations.push_back({path,data,entry});
+     pthread_cond_signal(&invalidations_cond);
+     plocklib_release_simple_lock(&invalidations_lock);
+}
+
+void* notify_thread(void* ignored)
+{
+     while(true)
+     {
+          plocklib_acquire_simple_lock(&invalidations_lock);
+          while(invalidations.empty())
+               pthread_cond_wait(&invalidations_cond,&invalidations_lock);
+          vector<invalidation> batch;
+          batch.swap(invalidations);
+          plocklib_release_simple_lock(&invalidations_lock);
+
+          plocklib_acquire_simple_lock(&session_lock);
+          for(const auto& x : batch)
+          {
+               fuse_ino_t ino, parent;
+               plocklib_acquire_simple_lock(&inodes_lock);
+               bool known = path_inode_locked(x.path,ino,parent);
+               plocklib_release_simple_lock(&inodes_lock);
+               //Nothing cached about paths the kernel never looked up.
+               if(!known || !session)
+                    continue;
+               if(x.entry && parent)
+               {
+                    string name = x.path.substr(x.path.rfind('/')+1);
+                    fuse_lowlevel_notify_inval_entry(session,parent,name.c_str(),name.size());
+               }
+               else
+                    fuse_lowlevel_notify_inval_inode(session,ino,x.data ? 0 : -1,0);
+          }
+          plocklib_release_simple_lock(&session_lock);
+     }
+}
+
+//upper/.tefs holds our own state and isn't part of the filesystem.
+static bool reserved(const char* path)
+{
+     return !strncmp(path,"/.tefs",6) && (!path[6] || path[6]=='/');
+}
+
+static bool exists(string path)
+{
+     return !faccessat(AT_FDCWD,path.c_str(),F_OK,AT_SYMLINK_NOFOLLOW);
+}
+
+static bool special(string path)
+{
+     struct stat buf;
+     lstat(path.c_str(),&buf);
+     return ! (S_ISREG(buf.st_mode) || S_ISLNK(buf.st_mode));
+}
+
+//Count the time since started spent waiting for a path lock.
+static void path_locked(double started)
+{
+     stats.count(PATH_LOCKS);
+     stats.count(PATH_LOCK_WAIT_US,(monotonic_now()-started)*1000000);
+}
+
+//wait until unfrozen then keep lock
+static void wuutkl(const string& path)
+{
+     double started = monotonic_now();
+     plocklib_lock_path(&path_locks,path,PLOCKLIB_IS);
+     path_locked(started);
+}
+
+//Let go of what wuutkl took.
+static void resign(const string& path)
+{
+     plocklib_unlock_path(&path_locks,path,PLOCKLIB_IS);
+}
+
+//Wait until nobody is using path, then keep them out until thaw.
+static void freeze(const string& path)
+{
+     double started = monotonic_now();
+     plocklib_lock_path(&path_locks,path,PLOCKLIB_X);
+     path_locked(started);
+}
+
+static void thaw(const string& path)
+{
+     plocklib_unlock_path(&path_locks,path,PLOCKLIB_X);
+}
+
+//Turn a freeze back into what wuutkl gives, without letting anyone
+//else freeze the path in between.
+static void thaw_and_keep(const string& path)
+{
+     plocklib_downgrade_path(&path_locks,path,PLOCKLIB_X,PLOCKLIB_IS);
+}
+
+static bool is_frozen(const string& path)
+{
+     return plocklib_path_held(&path_locks,path,PLOCKLIB_X);
+}
+
+//Record where path is.  In two-way mode lower can change under us, so
+//the answer only holds for layer_ttl seconds.
+static void remember(const string& path, layer_cache::layer where)
+{
+     layers.set(path,where,two_way ? config.layer_ttl : 0);
+}
+
+//dir and all its ancestors now exist in upper.
+static void remember_upper_dirs(const string& dir)
+{
+     plocklib_for_each_ancestor(dir,[](const string& x) { remember(x,layer_cache::UPPER); });
+     if(dir.size())
+          remember(dir,layer_cache::UPPER);
+}
+
+//A name has come or gone in path's directory.
+static void listing_changed(const string& path)
+{
+     string dir = copylib_parent(path);
+     listings.erase(dir.empty() ? "/" : dir);
+}
+
+static bool is_upper(const string& fname)
+{
+     return fname.size() > upper.size() && !fname.compare(0,upper.size(),upper) && fname[upper.size()]=='/';
+}
+
+//Point every open handle of path at fname instead.  Called with path
+//frozen, after a copy has moved the file from one layer to the
+//other.  dup2 swaps the backing file in place,
+//so concurrent reads using the old descriptor stay safe.
+static void rebind_open_files(const string& path, const string& fname, bool on_upper)
+{
+     plocklib_acquire_simple_lock(&open_files_lock);
+     auto it = open_files.find(path);
+     if(it!=open_files.end())
+          for(auto of : it->second)
+          {
+               if(of->on_upper==on_upper)
+                    continue;
+               int fd = open(fname.c_str(),of->flags & ~(O_CREAT | O_EXCL | O_TRUNC));
+               if(fd==-1)
+                    continue;
+               dup2(fd,of->fd);
+               close(fd);
+               of->on_upper = on_upper;
+               of->cache_id = 0;
+               struct stat st;
+               if(!on_upper && !fstat(of->fd,&st))
+                    of->cache_id = blocks.file_id(st);
+          }
+     plocklib_release_simple_lock(&open_files_lock);
+}
+
+static bool is_open(const string& path)
+{
+     plocklib_acquire_simple_lock(&open_files_lock);
+     bool to_return = open_files.count(path);
+     plocklib_release_simple_lock(&open_files_lock);
+     return to_return;
+}
+
+//Is path open for writing by anyone?
+static bool has_open_writers(const string& path)
+{
+     bool to_return = false;
+     plocklib_acquire_simple_lock(&open_files_lock);
+     auto it = open_files.find(path);
+     if(it!=open_files.end())
+          for(auto of : it->second)
+               if((of->flags & O_ACCMODE)!=O_RDONLY)
+                    to_return = true;
+     plocklib_release_simple_lock(&open_files_lock);
+     return to_return;
+}
+
+//Rekey the open handles of from (and of everything under it, if it
+//is a directory) to to.
+static void rename_open_files(const string& from, const string& to)
+{
+     plocklib_acquire_simple_lock(&open_files_lock);
+     auto moved = extract_tree(open_files,from);
+     for(auto& x : moved)
+     {
+          string newpath = to+x.key().substr(from.length());
+          for(auto of : x.mapped())
+               of->path = newpath;
+          open_files[newpath].insert(x.mapped().begin(),x.mapped().end());
+     }
+     plocklib_release_simple_lock(&open_files_lock);
+}
+
+//path is gone; its open handles keep their descriptors but are no
+//longer reachable by path.
+static void forget_open_files(const string& path)
+{
+     plocklib_acquire_simple_lock(&open_files_lock);
+     auto it = open_files.find(path);
+     if(it!=open_files.end())
+     {
+          for(auto of : it->second)
+               of->path.clear();
+          open_files.erase(it);
+     }
+     plocklib_release_simple_lock(&open_files_lock);
+}
+
+/*A file copied up lazily whose chunks haven't all arrived yet.  Reads
+  of absent chunks go to lower; writes fetch the absent chunks they
+  only partly cover first.  fill_thread fetches the rest.  lock covers
+  chunks and the contents of the upper file.*/
+struct partial_file
+{
+     chunk_map chunks;
+     int lower;               //held open, so renames and unlinks in lower don't lose it
+     int upper;
+     unsigned unsaved = 0;    //chunks fetched since the bitmap was last written
+     plocklib_simple_t lock = PTHREAD_MUTEX_INITIALIZER;
+     //For fill_thread, protected by partial_files_lock: fetches in a
+     //row that failed, and when to try again.
+     unsigned failures = 0;
+     time_t retry_at = 0;
+
+     partial_file(const chunk_map& chunks, int lower, int upper)
+          : chunks(chunks), lower(lower), upper(upper)
+     {
+     }
+
+     ~partial_file()
+     {
+          close(lower);
+          close(upper);
+     }
+};
+
+//Locking order: partial_files_lock, then a partial_file's lock, both
+//after path_locks.
+static plocklib_simple_t partial_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t partial_files_cond = PTHREAD_COND_INITIALIZER;
+static map<string,shared_ptr<partial_file>> partial_files;
+
+static shared_ptr<partial_file> find_partial(const string& path)
+{
+     shared_ptr<partial_file> to_return;
+     plocklib_acquire_simple_lock(&partial_files_lock);
+     auto it = partial_files.find(path);
+     if(it!=partial_files.end())
+          to_return = it->second;
+     plocklib_release_simple_lock(&partial_files_lock);
+     return to_return;
+}
+
+static void add_partial(const string& path, shared_ptr<partial_file> pf)
+{
+     plocklib_acquire_simple_lock(&partial_files_lock);
+     partial_files.emplace(path,pf);
+     pthread_cond_broadcast(&partial_files_cond);
+     plocklib_release_simple_lock(&partial_files_lock);
+}
+
+//Pick up a file an earlier run left half copied up.
+static shared_ptr<partial_file> load_partial(const string& path)
+{
+     auto pf = find_partial(path);
+     if(pf)
+          return pf;
+
+     string rel = copylib_relative(path);
+     int up = openat(upper_fd,rel.c_str(),O_RDWR | O_NOFOLLOW);
+     if(up==-1)
+          return pf;
+     chunk_map chunks;
+     if(chunks.load(up))
+     {
+          close(up);
+          return pf;
+     }
+     int low = openat(lower_fd,rel.c_str(),O_RDONLY | O_NOFOLLOW);
+     if(low==-1)
+     {
+          cerr << "Lower copy of partial file " << path << " is gone: " << strerror(errno) << endl;
+          close(up);
+          return pf;
+     }
+
+     pf = make_shared<partial_file>(chunks,low,up);
+     add_partial(path,pf);
+     return find_partial(path);
+}
+
+//Drop path (and everything under it) from partial_files.
+static void forget_partial(const string& path)
+{
+     plocklib_acquire_simple_lock(&partial_files_lock);
+     extract_tree(partial_files,path);
+     plocklib_release_simple_lock(&partial_files_lock);
+}
+
+static void rename_partial(const string& from, const string& to)
+{
+     plocklib_acquire_simple_lock(&partial_files_lock);
+     rename_tree(partial_files,from,to);
+     plocklib_release_simple_lock(&partial_files_lock);
+}
+
+//Write the bitmap out, after the data it vouches for.  Call with
+//pf.lock held.
+static int save_chunks(partial_file& pf)
+{
+     if(fdatasync(pf.upper)==-1)
+          return -errno;
+     pf.unsaved = 0;
+     return pf.chunks.save(pf.upper);
+}
+
+//Copy chunk from lower.  Call with pf.lock held.
+static int fetch_chunk(partial_file& pf, size_t chunk)
+{
+     if(pf.chunks.has(chunk))
+          return 0;
+     off_t start = (off_t)chunk*CHUNKMAP_CHUNK;
+     off_t end = min<off_t>(start+CHUNKMAP_CHUNK,pf.chunks.size());
+     int res = copylib_copy_range(pf.lower,pf.upper,start,end-start);
+     if(res)
+          return res;
+     stats.count(BYTES_COPIED_UP,end-start);
+     pf.chunks.set(chunk);
+     pf.unsaved++;
+     return 0;
+}
+
+//Get pf ready for a write to [start,end): chunks only partly
+//overwritten are fetched, the rest are about to be present.  Call
+//with pf.lock held.
+static int prepare_partial_write(partial_file& pf, off_t start, off_t end)
+{
+     if(start>=end)
+          return 0;
+     size_t first = start/CHUNKMAP_CHUNK, last = (end-1)/CHUNKMAP_CHUNK;
+     int res = 0;
+     if(start%CHUNKMAP_CHUNK)
+          res = fetch_chunk(pf,first);
+     if(!res && end%CHUNKMAP_CHUNK && end<pf.chunks.size())
+          res = fetch_chunk(pf,last);
+     if(res)
+          return res;
+     for(size_t i=first; i<=last; i++)
+          pf.chunks.set(i);
+     return 0;
+}
+
+//Get pf ready for a truncate to size: past the cut, upper is the
+//authority from now on.  Call with pf.lock held.
+static int prepare_partial_truncate(partial_file& pf, off_t size)
+{
+     struct stat st;
+     if(fstat(pf.upper,&st)==-1)
+          return -errno;
+     off_t cut = min(size,st.st_size);
+     size_t chunk = cut/CHUNKMAP_CHUNK;
+     if(cut%CHUNKMAP_CHUNK)
+     {
+          int res = fetch_chunk(pf,chunk);
+          if(res)
+               return res;
+          chunk++;
+     }
+     pf.chunks.set_from(chunk);
+     return 0;
+}
+
+/*Where [offset,offset+size) of pf, open as fd, is to be read from:
+  upper for the chunks it has, lower for the rest.  Adds a buffer per
+  run of chunks to bufs, for libfuse to splice from, and returns the
+  number of bytes they cover or -errno.  Call with pf's lock held,
+  until the buffers have been read.*/
+static ssize_t map_partial(partial_file& pf, int fd, size_t size, off_t offset, vector<fuse_buf>& bufs)
+{
+     //Past the end of lower, where upper has been extended.
+     static vector<char> zeros(CHUNKMAP_CHUNK);
+     struct stat st, lst;
+     if(fstat(fd,&st)==-1 || fstat(pf.lower,&lst)==-1)
+          return -errno;
+     if(offset>=st.st_size)
+          return 0;
+     size = min<off_t>(size,st.st_size-offset);
+
+     size_t done = 0;
+     while(done<size)
+     {
+          off_t pos = offset+done;
+          size_t chunk = pos/CHUNKMAP_CHUNK;
+          size_t len = min<off_t>(size-done,(off_t)(chunk+1)*CHUNKMAP_CHUNK-pos);
+          bool have = pf.chunks.has(chunk);
+          if(!have && pos>=lst.st_size)
+               bufs.push_back({len,(fuse_buf_flags) 0,zeros.data(),-1,0});
+          else
+          {
+               if(!have)
+                    len = min<off_t>(len,lst.st_size-pos);
+               int from = have ? fd : pf.lower;
+               //Runs of chunks from the same file are one buffer.
+               if(bufs.size() && bufs.back().fd==from && bufs.back().pos+(off_t)bufs.back().size==pos)
+                    bufs.back().size += len;
+               else
+                    bufs.push_back({len,(fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK),NULL,from,pos});
+          }
+          done += len;
+     }
+     return done;
+}
+
+//Fetch every chunk of pf now.
+static int complete_partial(partial_file& pf)
+{
+     int res = 0;
+     plocklib_acquire_simple_lock(&pf.lock);
+     for(size_t i = pf.chunks.next_missing(0); !res && i<pf.chunks.chunks(); i = pf.chunks.next_missing(i))
+          res = fetch_chunk(pf,i);
+     if(!res)
+          res = save_chunks(pf);
+     plocklib_release_simple_lock(&pf.lock);
+     return res;
+}
+
+//path has every chunk: it's an ordinary upper file from now on.
+static void finish_partial(const string& path, const shared_ptr<partial_file>& pf)
+{
+     plocklib_acquire_simple_lock(&partial_files_lock);
+     auto it = partial_files.find(path);
+     if(it!=partial_files.end() && it->second==pf)
+          partial_files.erase(it);
+     plocklib_release_simple_lock(&partial_files_lock);
+     chunk_map::unmark(pf->upper);
+}
+
+/*Copy path up as a sparse file whose chunks arrive later.  Called
+  with path frozen, instead of copylib_copy.*/
+static int lazy_copy_up(const string& path)
+{
+     string rel = copylib_relative(path);
+     int in = openat(lower_fd,rel.c_str(),O_RDONLY | O_NOFOLLOW);
+     if(in==-1)
+          return -errno;
+
+     struct stat st;
+     string temp = copylib_temp_name(rel);
+     int out = -1, res = 0;
+     if(fstat(in,&st)==-1 || (out = openat(upper_fd,temp.c_str(),O_RDWR | O_CREAT | O_EXCL,0600))==-1)
+          res = -errno;
+     chunk_map chunks(st.st_size);
+     if(!res && ftruncate(out,st.st_size)==-1)
+          res = -errno;
+     if(!res)
+          res = chunks.save(out);
+     if(!res)
+     {
+          copylib_copy_attrs(in,out,st);
+          if(renameat(upper_fd,temp.c_str(),upper_fd,rel.c_str())==-1)
+               res = -errno;
+     }
+
+     if(res)
+     {
+          if(out!=-1)
+          {
+               close(out);
+               unlinkat(upper_fd,temp.c_str(),0);
+          }
+          close(in);
+          return res;
+     }
+
+     add_partial(path,make_shared<partial_file>(chunks,in,out));
+     return 0;
+}
+
+//Fetches the chunks of partial files nobody has asked for yet, a
+//file at a time.
+void* fill_thread(void* ignored)
+{
+     string last;
+     while(true)
+     {
+          //The next file after last that isn't waiting out a failure.
+          plocklib_acquire_simple_lock(&partial_files_lock);
+          map<string,shared_ptr<partial_file>>::iterator it;
+          while(true)
+          {
+               while(partial_files.empty())
+                    pthread_cond_wait(&partial_files_cond,&partial_files_lock);
+               time_t now = time(NULL), soonest = numeric_limits<time_t>::max();
+               it = partial_files.upper_bound(last);
+               size_t n;
+               for(n=0; n<partial_files.size(); n++, ++it)
+               {
+                    if(it==partial_files.end())
+                         it = partial_files.begin();
+                    if(it->second->retry_at <= now)
+                         break;
+                    soonest = min(soonest,it->second->retry_at);
+               }
+               if(n<partial_files.size())
+                    break;
+               struct timespec timeout = {soonest,0};
+               pthread_cond_timedwait(&partial_files_cond,&partial_files_lock,&timeout);
+          }
+          string path = it->first;
+          auto pf = it->second;
+          plocklib_release_simple_lock(&partial_files_lock);
+          last = path;
+
+          plocklib_acquire_simple_lock(&pf->lock);
+          int res = 0;
+          size_t chunk = pf->chunks.next_missing(0);
+          if(chunk<pf->chunks.chunks())
+               res = fetch_chunk(*pf,chunk);
+          bool done = !pf->chunks.missing();
+          if(!res && (done || pf->unsaved>=64))
+               res = save_chunks(*pf);
+          plocklib_release_simple_lock(&pf->lock);
+
+          //Failing files are tried again after a second, doubling
+          //each time up to an hour, so they don't hold up the rest.
+          //Reads of what's missing go to lower meanwhile.
+          plocklib_acquire_simple_lock(&partial_files_lock);
+          if(res)
+          {
+               pf->failures++;
+               pf->retry_at = time(NULL)+min<time_t>(1L << min(pf->failures-1,12u),3600);
+          }
+          else
+               pf->failures = 0;
+          plocklib_release_simple_lock(&partial_files_lock);
+
+          if(res)
+               cerr << "Filling in " << path << " failed: " << strerror(-res) << endl;
+          else if(done)
+               finish_partial(path,pf);
+     }
+}
+
+static bool paths_overlap(const string& a, const string& b)
+{
+     const string& shorter = a.size() < b.size() ? a : b;
+     const string& longer = a.size() < b.size() ? b : a;
+     if(shorter.size()==longer.size())
+          return shorter==longer;
+     return !longer.compare(0,shorter.size(),shorter) && longer[shorter.size()]=='/';
+}
+
+//Call with pending_commits_lock held.
+static bool commit_busy(const string& path)
+{
+     for(const auto& x : active_commits)
+          if(paths_overlap(x,path))
+               return true;
+     return false;
+}
+
+//Wait until nothing is copying any of paths, then claim them.
+//Call with pending_commits_lock held.
+static void lock_commit_paths(initializer_list<string> paths)
+{
+     auto busy = [&]()
+          {
+               for(const auto& x : paths)
+                    if(commit_busy(x))
+                         return true;
+               return false;
+          };
+     while(busy())
+          pthread_cond_wait(&active_commits_cond,&pending_commits_lock);
+     active_commits.insert(paths);
+}
+
+//Call with pending_commits_lock held.
+static void unlock_commit_paths(initializer_list<string> paths)
+{
+     for(const auto& x : paths)
+          active_commits.erase(active_commits.find(x));
+     pthread_cond_broadcast(&active_commits_cond);
+     //Commits and attribute changes that were held up by these may be
+     //able to go now.
+     pthread_cond_broadcast(&commits_cond);
+     pthread_cond_broadcast(&attrs_cond);
+}
+
+//Is lower still the file we left there?
+static bool same_lower(const struct stat& a, const struct stat& b)
+{
+     return a.st_dev==b.st_dev && a.st_ino==b.st_ino && a.st_size==b.st_size &&
+          a.st_mtim.tv_sec==b.st_mtim.tv_sec && a.st_mtim.tv_nsec==b.st_mtim.tv_nsec;
+}
+
+//path was just copied from lower to upper, so the two match.  A
+//lazy copy's bytes are counted by fetch_chunk as they arrive.
+static void copied_up(const string& path, bool lazy = false)
+{
+     struct stat st;
+     bool known = !fstatat(lower_fd,copylib_relative(path).c_str(),&st,AT_SYMLINK_NOFOLLOW);
+     stats.count(FILES_COPIED_UP);
+     if(known && !lazy)
+          stats.count(BYTES_COPIED_UP,st.st_size);
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     auto& state = commit_states[path];
+     state.known = known;
+     state.base = st;
+     state.hashed = false;
+     state.dirty.clear();
+     attr_change change;
+     auto queued = attr_changes.find(path);
+     if(queued)
+          change = *queued;
+     plocklib_release_simple_lock(&pending_commits_lock);
+
+     //The copy has lower's attributes, so give it the ones still on
+     //their way there.
+     if(queued)
+          change.apply(upper_fd,copylib_relative(path));
+}
+
+//Move the commit state of from (and of everything under it) to to,
+//dropping whatever to had.  Call with pending_commits_lock held.
+static void rename_commit_states(const string& from, const string& to)
+{
+     extract_tree(commit_states,to);
+     rename_tree(commit_states,from,to);
+}
+
+//Queue a commit of path, journaling it if it wasn't queued already.
+//Call with pending_commits_lock held.
+static void queue_commit(const string& path, bool now = false)
+{
+     off_t size = 0;
+     struct stat st;
+     if(policy.uses_size() && !fstatat(upper_fd,copylib_relative(path).c_str(),&st,AT_SYMLINK_NOFOLLOW))
+          size = st.st_size;
+     const auto& rule = policy.match(path,size);
+     if(rule.never)
+          return;
+
+     //Every change puts the commit off again, up to max_delay after
+     //the first one.
+     time_t when = time(NULL);
+     auto& state = commit_states[path];
+     bool queued = pending_commits.contains(path);
+     if(!queued)
+     {
+          journal.append('E',path);
+          state.latest = when+rule.max_delay;
+     }
+     state.delay = rule.delay;
+     time_t due = now ? when : min(when+rule.delay,state.latest);
+     if(pending_commits.empty() || due < pending_commits.next_due())
+          pthread_cond_broadcast(&commits_cond);
+     pending_commits.push(path,due);
+}
+
+//Call with pending_commits_lock held.
+static void queue_luc(const string& path, time_t due)
+{
+     bool sooner = pending_luc.empty() || due < pending_luc.next_due();
+     if(pending_luc.push_if_absent(path,due))
+     {
+          journal.append('L',path);
+          if(sooner)
+               pthread_cond_signal(&luc_cond);
+     }
+}
+
+/*Sleep on cond until the earliest entry in queue is due, or cond is
+  signalled.  Entries that are due but were passed over, being busy,
+  are tried again after a second.  With ready false, nothing could be
+  started anyway, so only a signal will do.  Call with
+  pending_commits_lock held.*/
+static void wait_until_due(const commit_queue& queue, pthread_cond_t* cond, bool ready = true)
+{
+     if(!ready || queue.empty())
+     {
+          pthread_cond_wait(cond,&pending_commits_lock);
+          return;
+     }
+     struct timespec timeout = {max(queue.next_due(),time(NULL)+1),0};
+     pthread_cond_timedwait(cond,&pending_commits_lock,&timeout);
+}
+
+/*Commit path now, in the urgent lane, if it has changes queued.  Call
+  with pending_commits_lock held.*/
+static void expedite(const string& path)
+{
+     if(!pending_commits.contains(path))
+          return;
+     time_t now = time(NULL);
+     pending_commits.push(path,now);
+     urgent_commits.push(path,now);
+     commit_states[path].error = 0;
+     pthread_cond_broadcast(&commits_cond);
+}
+
+/*Wait until nothing of path is left to commit but changes made from
+  now on.  Returns 0, or -errno if the commit failed (it will be
+  retried in the bulk lane).  Call with pending_commits_lock held.*/
+static int wait_for_commit(const string& path)
+{
+     while(urgent_commits.contains(path) || active_commits.count(path))
+          pthread_cond_wait(&commits_cond,&pending_commits_lock);
+     auto state = commit_states.find(path);
+     return state==commit_states.end() ? 0 : state->second.error;
+}
+
+//Drop path from both queues, and its attribute changes.  Call with
+//pending_commits_lock held.
+static void cancel_queued(const string& path)
+{
+     bool commit = pending_commits.cancel(path);
+     bool luc = pending_luc.cancel(path);
+     if(commit || luc)
+          journal.append('X',path);
+     attr_changes.cancel(path);
+     attrs_queued = attr_changes.size();
+}
+
+//Show what attr_changes has queued for path on top of st.
+static void queued_attrs(const string& path, struct stat* st)
+{
+     if(!attrs_queued)
+          return;
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     auto change = attr_changes.find(path);
+     if(change)
+          change->overlay(*st);
+     plocklib_release_simple_lock(&pending_commits_lock);
+}
+
+//Rewrite the journal as just what's queued or in flight now.  Only
+//taking the records is done with pending_commits_lock held; the
+//syncing and renaming aren't.  Call without it.
+static int compact_journal()
+{
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     int res = journal.start_compact([](const function<void(char,const string&,const string&)>& emit)
+                            {
+                                 pending_commits.for_each([&](const string& x, time_t) { emit('E',x,""); });
+                                 pending_luc.for_each([&](const string& x, time_t) { emit('L',x,""); });
+                                 //Half-done commits have to be redone.  The other
+                                 //claims are harmless to commit.
+                                 for(const auto& x : active_commits)
+                                      if(!pending_commits.contains(x))
+                                           emit('E',x,"");
+                                 for(const auto& x : unflushed)
+                                      emit('E',x,"");
+                            });
+     plocklib_release_simple_lock(&pending_commits_lock);
+     //Someone else is at it already.
+     if(res==-EBUSY)
+          return 0;
+     return res ? res : journal.finish_compact();
+}
+
+//Makes the journal durable every second, and compacts it once it is
+//mostly dead records.
+void* journal_thread(void* ignored)
+{
+     while(true)
+     {
+          sleep(1);
+          int res = journal.sync();
+          if(res)
+               cerr << "Syncing the journal failed: " << strerror(-res) << endl;
+
+          plocklib_acquire_simple_lock(&pending_commits_lock);
+          size_t live = pending_commits.size()+pending_luc.size()+active_commits.size();
+          plocklib_release_simple_lock(&pending_commits_lock);
+          if(journal.size() > 10000 && journal.size() > 4*live && (res = compact_journal()))
+               cerr << "Compacting the journal failed: " << strerror(-res) << endl;
+     }
+}
+
+//How long to wait before trying again a commit that has failed
+//failures times in a row: commit_delay, doubling each time, up to an
+//hour.
+static time_t retry_delay(unsigned failures)
+{
+     return min<time_t>(max<time_t>(config.commit_delay,1) << min(failures-1,12u),3600);
+}
+
+//Sleep until a commit of this many bytes fits within commit_rate and
+//commit_bandwidth.  Reservations are handed out in virtual time, so
+//the workers share the budget between them.
+static void throttle_commit(off_t bytes, unsigned files = 1)
+{
+     static plocklib_simple_t throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+     static double next_file = 0, next_byte = 0;
+
+     if(flush_time || (!config.commit_rate && !config.commit_bandwidth))
+          return;
+
+     plocklib_acquire_simple_lock(&throttle_lock);
+     double now = monotonic_now();
+     double start = now;
+     if(config.commit_rate)
+     {
+          next_file = max(next_file,now);
+          start = max(start,next_file);
+          next_file += (double)files/config.commit_rate;
+     }
+     if(config.commit_bandwidth)
+     {
+          next_byte = max(next_byte,now);
+          start = max(start,next_byte);
+          next_byte += (double)bytes/config.commit_bandwidth;
+     }
+     plocklib_release_simple_lock(&throttle_lock);
+
+     if(start > now)
+          usleep((useconds_t)((start-now)*1000000));
+}
+
+//How one file's commit went.
+struct commit_result
+{
+     int res = 0;
+     bool committed = false;  //lower has it, looking like lst
+     bool deferred = false;   //partial file that can't go yet
+     struct stat lst;
+     bool hashed = false;     //fingerprint is of what lst holds
+     uint64_t fingerprint = 0;
+};
+
+//Whether path is small enough to go in a batch; adds its size to
+//bytes if so.
+static bool batchable(const string& path, off_t& bytes)
+{
+     struct stat st;
+     if(path.find(".fuse_hidden")!=string::npos ||
+        fstatat(upper_fd,copylib_relative(path).c_str(),&st,AT_SYMLINK_NOFOLLOW) ||
+        !S_ISREG(st.st_mode) || st.st_size > (off_t)config.commit_batch_size)
+          return false;
+     bytes += st.st_size;
+     return true;
+}
+
+/*batch holds a path just taken off pending_commits; if it's a small
+  file, take whatever else small is due in the same directory too.
+  Files still open for writing are left to settle, as in
+  commits_thread.  Returns the bytes in the batch.  Call with
+  pending_commits_lock held.*/
+template<typename Predicate>
+static off_t take_batch(vector<string>& batch, time_t now, Predicate busy)
+{
+     off_t bytes = 0;
+     if(config.commit_batch<2 || !batchable(batch[0],bytes))
+          return bytes;
+     string dir = copylib_parent(batch[0]);
+     pending_commits.pop_due_matching(now,[&](const string& x)
+                                      {
+                                           if(copylib_parent(x)!=dir || busy(x) || urgent_commits.contains(x))
+                                                return false;
+                                           auto state = commit_states.find(x);
+                                           if(!flush_time && state!=commit_states.end() && now < state->second.latest && has_open_writers(x))
+                                                return false;
+                                           return batchable(x,bytes);
+                                      },config.commit_batch-1,16*config.commit_batch,batch);
+     return bytes;
+}
+
+//Where fingerprint_xattr keeps fingerprints: on upper's copy, since
+//it's there to describe lower's and is local.
+#define FINGERPRINT_XATTR "user.tefs.fp"
+
+/*The fingerprint saved in upper's copy of path by the commit that
+  left lower's copy as it is now, if lower's copy is still lst.*/
+static bool saved_fingerprint(const string& path, const struct stat& lst, uint64_t& fp)
+{
+     char buf[256];
+     ssize_t len = lgetxattr((upper+"/"+path).c_str(),FINGERPRINT_XATTR,buf,sizeof(buf)-1);
+     if(len<=0)
+          return false;
+     buf[len] = '\0';
+     char algorithm[16];
+     unsigned long long hash, ino, size;
+     long long sec, nsec;
+     if(sscanf(buf,"%15s %llx %llu %llu %lld %lld",algorithm,&hash,&ino,&size,&sec,&nsec)!=6 ||
+        strcmp(algorithm,fingerprinter::algorithm()) || ino!=lst.st_ino || size!=(unsigned long long)lst.st_size ||
+        sec!=lst.st_mtim.tv_sec || nsec!=lst.st_mtim.tv_nsec)
+          return false;
+     fp = hash;
+     return true;
+}
+
+static void save_fingerprint(const string& path, const struct stat& lst, uint64_t fp)
+{
+     char buf[256];
+     int len = snprintf(buf,sizeof(buf),"%s %llx %llu %llu %lld %lld",fingerprinter::algorithm(),
+                        (unsigned long long)fp,(unsigned long long)lst.st_ino,(unsigned long long)lst.st_size,
+                        (long long)lst.st_mtim.tv_sec,(long long)lst.st_mtim.tv_nsec);
+     lsetxattr((upper+"/"+path).c_str(),FINGERPRINT_XATTR,buf,len,0);
+}
+
+//The fingerprint of lower's copy of path, lst, if we know it.
+static bool lower_fingerprint(const string& path, const struct stat& lst, const commit_state& taken, uint64_t& fp)
+{
+     if(taken.known && taken.hashed && same_lower(lst,taken.base))
+     {
+          fp = taken.fingerprint;
+          return true;
+     }
+     return config.fingerprint_xattr && saved_fingerprint(path,lst,fp);
+}
+
+static bool upper_fingerprint(const string& path, uint64_t& fp)
+{
+     int fd = openat(upper_fd,copylib_relative(path).c_str(),O_RDONLY | O_NOFOLLOW);
+     if(fd==-1)
+          return false;
+     bool to_return = !fingerprint_fd(fd,fp);
+     close(fd);
+     return to_return;
+}
+
+//Give lower's copy of path upper's attributes, its data being the
+//same already.
+static int commit_attrs(const string& path, const struct stat& st, bool durable)
+{
+     string rel = copylib_relative(path);
+     int in = openat(upper_fd,rel.c_str(),O_RDONLY | O_NOFOLLOW);
+     if(in==-1)
+          return -errno;
+     int out = openat(lower_fd,rel.c_str(),O_RDONLY | O_NOFOLLOW);
+     if(out==-1)
+     {
+          int res = -errno;
+          close(in);
+          return res;
+     }
+     copylib_copy_attrs(in,out,st);
+     //Lower's data may not have reached its disk when it was written.
+     int res = durable && fsync(out)==-1 ? -errno : 0;
+     close(out);
+     close(in);
+     return res;
+}
+
+static bool same_mtime(const struct stat& a, const struct stat& b)
+{
+     return a.st_mtim.tv_sec==b.st_mtim.tv_sec && a.st_mtim.tv_nsec==b.st_mtim.tv_nsec;
+}
+
+/*Copy one file (or symlink) to lower, as a delta when lower still
+  has what the last commit left, or not at all when lower has the same
+  bytes already.  Returns whether it was slow.*/
+static bool commit_one(const string& path, const commit_state& taken, bool urgent, commit_result& result)
+{
+     struct stat st;
+     if(path.find(".fuse_hidden")!=string::npos ||
+        lstat((upper+"/"+path).c_str(),&st) || (!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode)))
+          return false;
+
+     //Only the dirty extents need to go if lower is
+     //still what the last commit or copy-up left there.
+     string rel = copylib_relative(path);
+     struct stat lst;
+     bool have_lower = S_ISREG(st.st_mode) && !fstatat(lower_fd,rel.c_str(),&lst,AT_SYMLINK_NOFOLLOW);
+     bool delta = have_lower && taken.known && same_lower(lst,taken.base);
+
+     //A partial file can only go out as a delta: the rest
+     //of it is still in lower.
+     auto pf = find_partial(path);
+     if(!pf && S_ISREG(st.st_mode) && st.st_size >= CHUNKMAP_CHUNK && chunk_map::marked_path((upper+"/"+path).c_str()))
+          pf = load_partial(path);
+     result.deferred = pf && !delta;
+     if(result.deferred)
+          return false;
+
+     //Nothing has to go if lower has these bytes already: going by
+     //size and mtime, like rsync, or else by fingerprint, which
+     //catches files rewritten with the same bytes.  Reading all of
+     //upper to hash it only pays when the whole file would go
+     //otherwise, and then only when there's a fingerprint of lower's
+     //to compare with, or the file is small enough to fingerprint for
+     //next time anyway.  Partial files are left out, upper not having
+     //all of their bytes.
+     bool comparable = have_lower && !pf && lst.st_size==st.st_size;
+     bool unchanged = false, hashed = false;
+     uint64_t fp = 0, lower_fp;
+     if(comparable && same_mtime(st,lst))
+     {
+          unchanged = true;
+          hashed = lower_fingerprint(path,lst,taken,fp);
+     }
+     else if(S_ISREG(st.st_mode) && !pf && !delta && config.fingerprint_max && st.st_size <= (off_t)config.fingerprint_max)
+     {
+          bool known = comparable && lower_fingerprint(path,lst,taken,lower_fp);
+          if(known || st.st_size <= (off_t)config.commit_batch_size)
+               hashed = upper_fingerprint(path,fp);
+          unchanged = hashed && known && lower_fp==fp;
+     }
+
+     off_t bytes = unchanged ? 0 : st.st_size;
+     if(delta && !unchanged)
+     {
+          bytes = 0;
+          for(const auto& x : taken.dirty)
+               bytes += max<off_t>(0,min(x.second,st.st_size)-x.first);
+     }
+     if(!urgent)
+          throttle_commit(bytes);
+
+     double started = monotonic_now();
+     int res;
+     //Someone is waiting in fsync for these, so they have to reach
+     //lower's disk, not just its cache.
+     if(unchanged)
+          res = commit_attrs(path,st,urgent);
+     else if(delta)
+          res = copylib_copy_extents(upper_fd,lower_fd,path,taken.dirty,urgent);
+     else
+     {
+          res = copylib_mkdirs(upper_fd,lower_fd,copylib_parent(path));
+          if(!res)
+               res = copylib_copy(upper_fd,lower_fd,path,urgent);
+     }
+     double elapsed = monotonic_now()-started;
+     stats.record(OP_COMMIT,elapsed);
+     result.res = res;
+     if(res)
+     {
+          cerr << "Commit of " << path << " failed: " << strerror(-res) << endl;
+          stats.count(COMMIT_ERRORS);
+     }
+     else
+     {
+          result.committed = !fstatat(lower_fd,rel.c_str(),&result.lst,AT_SYMLINK_NOFOLLOW);
+          if(unchanged)
+          {
+               stats.count(FILES_UNCHANGED);
+               stats.count(BYTES_SAVED,st.st_size);
+          }
+          else
+          {
+               stats.count(FILES_COMMITTED);
+               stats.count(BYTES_COMMITTED,bytes);
+          }
+
+          //The fingerprint is only lower's if upper didn't change
+          //while it was taken and copied.
+          struct stat now;
+          result.hashed = hashed && result.committed && !lstat((upper+"/"+path).c_str(),&now) &&
+               now.st_size==st.st_size && same_mtime(now,st) &&
+               now.st_ctim.tv_sec==st.st_ctim.tv_sec && now.st_ctim.tv_nsec==st.st_ctim.tv_nsec;
+          result.fingerprint = fp;
+          if(result.hashed && config.fingerprint_xattr)
+               save_fingerprint(path,result.lst,fp);
+     }
+     bool slow = elapsed > config.commit_slow_ms/1000.0;
+     return slow;
+}
+
+/*Copy small files, all in one directory, to lower together: the
+  directory is created once, both copies of it opened once, and synced
+  once at the end.  Returns whether it was slow, going by the time per
+  file.*/
+static bool commit_batch(const vector<string>& batch, off_t bytes, vector<commit_result>& results)
+{
+     string dir = copylib_parent(batch[0]);
+     vector<string> names;
+     for(const auto& x : batch)
+          names.push_back(x.substr(x.rfind('/')+1));
+     throttle_commit(bytes,batch.size());
+
+     double started = monotonic_now();
+     vector<int> res;
+     vector<struct stat> lst;
+     int dir_res = copylib_mkdirs(upper_fd,lower_fd,dir);
+     if(!dir_res)
+          dir_res = copylib_copy_batch(upper_fd,lower_fd,dir,names,res,lst);
+     double elapsed = monotonic_now()-started;
+
+     for(size_t i=0; i<batch.size(); i++)
+     {
+          results[i].res = dir_res ? dir_res : res[i];
+          //Deleted since it was queued, which commit_one doesn't
+          //count as failing either.
+          if(results[i].res==-ENOENT && !dir_res &&
+             faccessat(upper_fd,copylib_relative(batch[i]).c_str(),F_OK,AT_SYMLINK_NOFOLLOW))
+               results[i].res = 0;
+          else if(results[i].res)
+          {
+               cerr << "Commit of " << batch[i] << " failed: " << strerror(-results[i].res) << endl;
+               stats.count(COMMIT_ERRORS);
+          }
+          else
+          {
+               results[i].committed = true;
+               results[i].lst = lst[i];
+               stats.count(FILES_COMMITTED);
+               stats.count(BYTES_COMMITTED,lst[i].st_size);
+          }
+          stats.record(OP_COMMIT,elapsed/batch.size());
+     }
+
+     batch_stats.batches++;
+     batch_stats.files += batch.size();
+     batch_stats.bytes += bytes;
+     batch_stats.usecs += elapsed*1000000;
+     return elapsed/batch.size() > config.commit_slow_ms/1000.0;
+}
+
+/*One of config.commit_workers threads copying due files to lower, or
+  (with urgent_only set) one of config.urgent_workers that only take
+  urgent commits, so a backlog of bulk ones can't hold those up.*/
+void* commits_thread(void* urgent_only)
+{
+     while(true)
+     {
+          plocklib_acquire_simple_lock(&pending_commits_lock);
+          string path;
+          time_t due;
+          //Everything is due when we're shutting down.
+          time_t now = flush_time ? numeric_limits<time_t>::max() : time(NULL);
+          auto busy = [&](const string& x)
+               {
+                    return is_frozen(x) || commit_busy(x);
+               };
+          bool urgent = false;
+          while(!urgent && urgent_commits.pop_due(now,busy,path,due))
+               if(!(urgent = pending_commits.cancel(path)))
+                    pthread_cond_broadcast(&commits_cond);
+          if(!urgent && (urgent_only || commits_in_flight >= commit_window ||
+                         !pending_commits.pop_due(now,busy,path,due)))
+          {
+               if(urgent_only)
+                    wait_until_due(urgent_commits,&commits_cond);
+               else
+                    wait_until_due(pending_commits,&commits_cond,commits_in_flight < commit_window);
+               plocklib_release_simple_lock(&pending_commits_lock);
+               continue;
+          }
+
+          //Still open for writing: wait for it to settle, up to its
+          //latest deadline.
+          auto state = commit_states.find(path);
+          if(!urgent && !flush_time && state!=commit_states.end() && now < state->second.latest && has_open_writers(path))
+          {
+               pending_commits.push(path,min(now+state->second.delay,state->second.latest));
+               plocklib_release_simple_lock(&pending_commits_lock);
+               continue;
+          }
+
+          //Small files due in the same directory go along with it.
+          //Urgent commits go alone, so nothing holds them up.
+          vector<string> batch = {path};
+          off_t bytes = urgent ? 0 : take_batch(batch,now,busy);
+
+          (urgent ? urgent_in_flight : commits_in_flight)++;
+
+          //Writes from here on are for the next commit.
+          vector<commit_state> taken(batch.size());
+          for(size_t i=0; i<batch.size(); i++)
+          {
+               active_commits.insert(batch[i]);
+               auto state = commit_states.find(batch[i]);
+               if(state!=commit_states.end())
+               {
+                    taken[i] = state->second;
+                    state->second.dirty.clear();
+               }
+          }
+          plocklib_release_simple_lock(&pending_commits_lock);
+
+          vector<commit_result> results(batch.size());
+          bool slow;
+          if(batch.size()>1)
+               slow = commit_batch(batch,bytes,results);
+          else
+               slow = commit_one(path,taken[0],urgent,results[0]);
+
+          plocklib_acquire_simple_lock(&pending_commits_lock);
+
+          //Put failed commits back in line unless the file
+          //has been requeued by a write in the meantime.  A failed
+          //delta may have left lower half-written, so the retry
+          //copies everything.
+          bool failed = false;
+          for(size_t i=0; i<batch.size(); i++)
+          {
+               const string& x = batch[i];
+               const auto& result = results[i];
+               if(result.res)
+               {
+                    failed = true;
+                    auto& state = commit_states[x];
+                    state.known = false;
+                    state.error = result.res;
+                    state.failures++;
+                    //Everything is due at once when unmounting, so
+                    //don't keep at it.
+                    if(flush_time && state.failures >= 3 && !pending_commits.contains(x))
+                         unflushed.insert(x);
+                    else
+                         pending_commits.push_if_absent(x,time(NULL)+retry_delay(state.failures));
+               }
+               //Waiting for fill_thread, which may be backing off a
+               //failing file for a long time: when unmounting, leave
+               //it for the next mount rather than spin on it.
+               else if(result.deferred && flush_time)
+               {
+                    if(!pending_commits.contains(x))
+                         unflushed.insert(x);
+               }
+               else if(result.deferred)
+                    pending_commits.push_if_absent(x,time(NULL)+config.commit_delay);
+               else
+               {
+                    if(!pending_commits.contains(x))
+                         journal.append('C',x);
+                    commits_done++;
+                    auto found = commit_states.find(x);
+                    if(found!=commit_states.end())
+                         found->second.failures = 0;
+                    if(result.committed)
+                    {
+                         auto& state = commit_states[x];
+                         state.known = true;
+                         state.base = result.lst;
+                         state.hashed = result.hashed;
+                         state.fingerprint = result.fingerprint;
+                    }
+                    //Small files go whole anyway, so their state
+                    //only saves a fingerprint, and not even that when
+                    //it's kept in an xattr.  Don't keep one for
+                    //every file ever committed.
+                    found = commit_states.find(x);
+                    if(found!=commit_states.end() && !pending_commits.contains(x) && found->second.dirty.empty() &&
+                       (!found->second.known || (found->second.base.st_size <= (off_t)config.commit_batch_size &&
+                                                 (!found->second.hashed || config.fingerprint_xattr))))
+                         commit_states.erase(found);
+               }
+               unlock_commit_paths({x});
+          }
+
+          //Halve the window when lower is struggling, grow it back
+          //one at a time when it isn't.
+          if(failed || slow)
+               commit_window = max(1u,commit_window/2);
+          else if(commit_window < config.commit_workers)
+               commit_window++;
+
+          (urgent ? urgent_in_flight : commits_in_flight)--;
+          pthread_cond_broadcast(&commits_cond);
+          plocklib_release_simple_lock(&pending_commits_lock);
+     }
+}
+
+void* luc_thread(void* ignored)
+{
+     while(true)
+     {
+          plocklib_acquire_simple_lock(&pending_commits_lock);
+          string path;
+          time_t due;
+          if(!pending_luc.pop_due(time(NULL),
+                                  [&](const string& x)
+                                  {
+                                       return is_frozen(x) || commit_busy(x);
+                                  },path,due))
+          {
+               wait_until_due(pending_luc,&luc_cond);
+               plocklib_release_simple_lock(&pending_commits_lock);
+               continue;
+          }
+          active_commits.insert(path);
+          plocklib_release_simple_lock(&pending_commits_lock);
+
+          freeze(path);
+          double started = monotonic_now();
+          int res = copylib_mkdirs(lower_fd,upper_fd,copylib_parent(path));
+          if(!res)
+               res = copylib_copy(lower_fd,upper_fd,path);
+          stats.record(OP_COPY_UP,monotonic_now()-started);
+          if(res)
+               cerr << "Copy of " << path << " to upper failed: " << strerror(-res) << endl;
+          else
+          {
+               copied_up(path);
+               rebind_open_files(path,upper+"/"+path,true);
+               remember_upper_dirs(copylib_parent(path));
+               remember(path,layer_cache::UPPER);
+               invalidate(path);
+          }
+          thaw(path);
+
+          plocklib_acquire_simple_lock(&pending_commits_lock);
+          if(!res)
+               journal.append('D',path);
+          unlock_commit_paths({path});
+          plocklib_release_simple_lock(&pending_commits_lock);
+     }
+}
+
+/*One of config.attr_workers threads making the attribute changes in
+  attr_changes in lower, a batch at a time.  A path with a commit
+  queued or running waits for it, so the change lands on whatever the
+  commit leaves in lower rather than being undone by it.*/
+void* attrs_thread(void* ignored)
+{
+     while(true)
+     {
+          plocklib_acquire_simple_lock(&pending_commits_lock);
+          vector<attr_queue::item> batch;
+          time_t now = flush_time ? numeric_limits<time_t>::max() : time(NULL);
+          attr_changes.take(now,[&](const string& x)
+                            {
+                                 return is_frozen(x) || commit_busy(x) ||
+                                      pending_commits.contains(x) || urgent_commits.contains(x);
+                            },max(config.commit_batch,1u),16*max(config.commit_batch,1u),batch);
+          if(batch.empty())
+          {
+               //Held up ones are retried when a commit finishes, and
+               //failed ones once due, looking every second.
+               struct timespec timeout = {time(NULL)+1,0};
+               if(attr_changes.empty())
+                    pthread_cond_wait(&attrs_cond,&pending_commits_lock);
+               else
+                    pthread_cond_timedwait(&attrs_cond,&pending_commits_lock,&timeout);
+               plocklib_release_simple_lock(&pending_commits_lock);
+               continue;
+          }
+          for(const auto& x : batch)
+               active_commits.insert(x.path);
+          plocklib_release_simple_lock(&pending_commits_lock);
+
+          //What became of each: done, retry, or given up on.
+          enum { DONE, RETRY, COMMIT, LOST };
+          vector<int> outcome(batch.size(),DONE);
+          for(size_t i=0; i<batch.size(); i++)
+          {
+               const auto& x = batch[i];
+               //Keeps copies up out until lower has the change.
+               wuutkl(x.path);
+               string rel = copylib_relative(x.path);
+               int res = x.change.apply(lower_fd,rel);
+               //Gone from lower since: nothing to change.
+               if(res && res!=-ENOENT)
+               {
+                    cerr << "Changing attributes of " << x.path << " in lower failed: " << strerror(-res) << endl;
+                    stats.count(COMMIT_ERRORS);
+                    outcome[i] = RETRY;
+                    //Everything is due at once when unmounting, so
+                    //don't keep at it.  Upper has the change too,
+                    //where there is an upper copy, and the next
+                    //mount's commit of it takes it along.
+                    if(flush_time && x.failures+1 >= 3)
+                         outcome[i] = faccessat(upper_fd,rel.c_str(),F_OK,AT_SYMLINK_NOFOLLOW) ? LOST : COMMIT;
+               }
+               else if(!res)
+                    stats.count(ATTRS_COMMITTED);
+               resign(x.path);
+          }
+
+          plocklib_acquire_simple_lock(&pending_commits_lock);
+          for(size_t i=0; i<batch.size(); i++)
+          {
+               const auto& x = batch[i];
+               if(outcome[i]==RETRY)
+                    attr_changes.failed(x.path,x.version,time(NULL)+retry_delay(x.failures+1));
+               else if(outcome[i]==DONE)
+                    attr_changes.done(x.path,x.version);
+               else
+               {
+                    attr_changes.cancel(x.path);
+                    if(outcome[i]==COMMIT)
+                         unflushed.insert(x.path);
+                    else
+                         attrs_lost++;
+               }
+               unlock_commit_paths({x.path});
+          }
+          attrs_queued = attr_changes.size();
+          plocklib_release_simple_lock(&pending_commits_lock);
+
+          //What getattr showed from the queue was wrong.
+          for(size_t i=0; i<batch.size(); i++)
+               if(outcome[i]==LOST)
+                    invalidate(batch[i].path);
+     }
+}
+
+/*Space manager.  Upper is only a cache of lower: once its device is
+  more than upper_high percent full, files lower already has are
+  deleted from upper, least recently used first, until it is down to
+  upper_low.  Reads of them then fall through to lower.*/
+static plocklib_simple_t space_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+//When files were last opened, on top of their atimes, which may not
+//be kept up to date.  Protected by space_lock.
+static map<string,time_t> last_used;
+static atomic<unsigned long> upper_hits{0}, upper_misses{0};
+static atomic<unsigned long> evicted_files{0}, evicted_bytes{0};
+
+static void touch(const string& path)
+{
+     plocklib_acquire_simple_lock(&space_lock);
+     last_used[path] = time(NULL);
+     plocklib_release_simple_lock(&space_lock);
+}
+
+//Ask the space manager to look at upper now rather than later.
+static void kick_space_manager()
+{
+     plocklib_acquire_simple_lock(&space_lock);
+     pthread_cond_signal(&space_cond);
+     plocklib_release_simple_lock(&space_lock);
+}
+
+//Percentage of upper's device in use, and bytes over upper_low.
+static double upper_usage(off_t* excess = NULL)
+{
+     struct statvfs sv;
+     if(statvfs(upper.c_str(),&sv)==-1 || !sv.f_blocks)
+          return 0;
+     double used = sv.f_blocks-sv.f_bavail;
+     if(excess)
+          *excess = max(0.0,(used-sv.f_blocks*config.upper_low/100.0)*sv.f_frsize);
+     return 100*used/sv.f_blocks;
+}
+
+struct eviction_candidate
+{
+     time_t used;
+     string path;
+     off_t space;
+};
+
+//Every regular file in the upper directory dir (which is closed
+//afterwards), and under it.
+static void find_eviction_candidates(int dir, const string& path, vector<eviction_candidate>& out)
+{
+     DIR* dp = fdopendir(dir);
+     if(!dp)
+     {
+          close(dir);
+          return;
+     }
+     struct dirent* de;
+     while((de = readdir(dp)))
+     {
+          if(!strcmp(de->d_name,".") || !strcmp(de->d_name,"..") || !strncmp(de->d_name,".tefs-copy.",11))
+               continue;
+          string child = path+"/"+de->d_name;
+          struct stat st;
+          if(reserved(child.c_str()) || fstatat(dirfd(dp),de->d_name,&st,AT_SYMLINK_NOFOLLOW))
+               continue;
+          if(S_ISDIR(st.st_mode))
+          {
+               int fd = openat(dirfd(dp),de->d_name,O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+               if(fd!=-1)
+                    find_eviction_candidates(fd,child,out);
+          }
+          else if(S_ISREG(st.st_mode))
+               out.push_back({st.st_atime,child,(off_t)st.st_blocks*512});
+     }
+     closedir(dp);
+}
+
+//Delete path from upper if lower has all of it and nobody is using
+//it.  Returns the bytes freed.
+static off_t evict(const string& path)
+{
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     if(pending_commits.contains(path) || commit_busy(path))
+     {
+          plocklib_release_simple_lock(&pending_commits_lock);
+          return 0;
+     }
+     active_commits.insert(path);
+     plocklib_release_simple_lock(&pending_commits_lock);
+
+     freeze(path);
+     string rel = copylib_relative(path);
+     struct stat ust, lst;
+     bool clean = !fstatat(upper_fd,rel.c_str(),&ust,AT_SYMLINK_NOFOLLOW) && S_ISREG(ust.st_mode) &&
+          !fstatat(lower_fd,rel.c_str(),&lst,AT_SYMLINK_NOFOLLOW) && S_ISREG(lst.st_mode) &&
+          ust.st_size==lst.st_size && ust.st_mtim.tv_sec==lst.st_mtim.tv_sec &&
+          ust.st_mtim.tv_nsec==lst.st_mtim.tv_nsec &&
+          !is_open(path) && !find_partial(path);
+     if(clean)
+     {
+          //A write may have queued it before we froze it.
+          plocklib_acquire_simple_lock(&pending_commits_lock);
+          auto state = commit_states.find(path);
+          clean = !pending_commits.contains(path) && (state==commit_states.end() || state->second.dirty.empty());
+          plocklib_release_simple_lock(&pending_commits_lock);
+     }
+     if(clean)
+          clean = !unlinkat(upper_fd,rel.c_str(),0);
+     if(clean)
+     {
+          remember(path,layer_cache::LOWER);
+          invalidate(path);
+     }
+     thaw(path);
+
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     if(clean)
+          commit_states.erase(path);
+     unlock_commit_paths({path});
+     plocklib_release_simple_lock(&pending_commits_lock);
+
+     if(!clean)
+          return 0;
+     plocklib_acquire_simple_lock(&space_lock);
+     last_used.erase(path);
+     plocklib_release_simple_lock(&space_lock);
+     return ust.st_blocks*512;
+}
+
+//Evict least recently used files until upper is under upper_low.
+//Returns how many were.
+static unsigned long make_room()
+{
+     off_t excess;
+     upper_usage(&excess);
+     int dir = dup(upper_fd);
+     if(dir==-1)
+          return 0;
+     vector<eviction_candidate> candidates;
+     find_eviction_candidates(dir,"",candidates);
+
+     plocklib_acquire_simple_lock(&space_lock);
+     for(auto& x : candidates)
+     {
+          auto it = last_used.find(x.path);
+          if(it!=last_used.end())
+               x.used = max(x.used,it->second);
+     }
+     plocklib_release_simple_lock(&space_lock);
+     sort(candidates.begin(),candidates.end(),
+          [](const eviction_candidate& a, const eviction_candidate& b) { return a.used < b.used; });
+
+     unsigned long files = 0, bytes = 0;
+     for(const auto& x : candidates)
+     {
+          if(excess<=0)
+          {
+               //Other writers may have filled it back up meanwhile.
+               upper_usage(&excess);
+               if(excess<=0)
+                    break;
+          }
+          off_t freed = evict(x.path);
+          if(freed)
+          {
+               files++;
+               bytes += freed;
+               excess -= freed;
+          }
+     }
+     evicted_files += files;
+     evicted_bytes += bytes;
+
+     if(!files)
+          return 0;
+     unsigned long hits = upper_hits, misses = upper_misses;
+     cerr << "Evicted " << files << " files (" << bytes << " bytes) from upper, now " << upper_usage()
+          << "% full; " << evicted_bytes << " bytes evicted in total, upper hit ratio "
+          << (hits+misses ? 100.0*hits/(hits+misses) : 100.0) << "%" << endl;
+     return files;
+}
+
+/*Looks at upper every 10 seconds, or when kicked.  A pass walks all
+  of upper, so after one that evicted nothing (everything being open,
+  dirty or not yet committed) it waits twice as long each time, up to
+  10 minutes.  Kicks in between only count if a commit has gone
+  through since, which may have made something evictable.*/
+void* space_thread(void* ignored)
+{
+     time_t interval = 10, last_pass = 0;
+     unsigned long seen = 0;
+     while(true)
+     {
+          plocklib_acquire_simple_lock(&space_lock);
+          struct timespec timeout;
+          clock_gettime(CLOCK_REALTIME,&timeout);
+          //A skipped kick doesn't put the next pass off.
+          timeout.tv_sec = interval>10 ? max<time_t>(last_pass+interval,timeout.tv_sec+1) : timeout.tv_sec+interval;
+          pthread_cond_timedwait(&space_cond,&space_lock,&timeout);
+          plocklib_release_simple_lock(&space_lock);
+
+          if(!config.upper_high || upper_usage() < config.upper_high)
+          {
+               interval = 10;
+               continue;
+          }
+          time_t now = time(NULL);
+          if(interval>10 && commits_done==seen && now < last_pass+interval)
+               continue;
+          seen = commits_done;
+          last_pass = now;
+          interval = make_room() ? 10 : min<time_t>(interval*2,600);
+     }
+}
+
+//Which layer path should be read from.  Call with path held.
+static string resolve(const char* path)
+{
+     layer_cache::layer where;
+     if(layers.lookup(path,where))
+     {
+          if(where!=layer_cache::LOWER)
+               return upper+"/"+path;
+          if(two_way)
+          {
+               plocklib_acquire_simple_lock(&pending_commits_lock);
+               queue_luc(path,time(NULL)+config.commit_delay);
+               plocklib_release_simple_lock(&pending_commits_lock);
+          }
+          return lower+"/"+path;
+     }
+
+     if(two_way)
+     {
+          bool lower_already_checked = false;
+          if(exists(upper+"/"+path))
+          {
+               struct stat buffer;
+               time_t utime, ltime;
+               
+               lstat((upper+"/"+path).c_str(),&buffer);
+               utime = buffer.st_mtime;
+               if(utime < 0)
+                    utime = 0;
+
+               if(exists(lower+"/"+path))
+               {
+                    lstat((lower+"/"+path).c_str(),&buffer);
+                    ltime = buffer.st_mtime;
+                    if(ltime < 0)
+                         ltime = 0;
+                    lower_already_checked = true;
+               }
+               else
+                    ltime = 0;
+
+               if(utime >= ltime || has_open_writers(path))
+               {
+                    remember(path,layer_cache::UPPER);
+                    return upper+"/"+path;
+               }
+
+               //Otherwise, both exist but lower is newer
+               //Delete upper file and quash any pending commits
+               plocklib_acquire_simple_lock(&pending_commits_lock);
+               unlink((upper+"/"+path).c_str());
+               cancel_queued(path);
+               commit_states.erase(path);
+               plocklib_release_simple_lock(&pending_commits_lock);
+               forget_partial(path);
+               rebind_open_files(path,lower+"/"+path,false);
+               invalidate(path,true);
+          }
+          if(lower_already_checked || exists(lower+"/"+path))
+          {
+               plocklib_acquire_simple_lock(&pending_commits_lock);
+               queue_luc(path,time(NULL)+config.commit_delay);
+               plocklib_release_simple_lock(&pending_commits_lock);
+               remember(path,layer_cache::LOWER);
+               return lower+"/"+path;
+          }
+     }
+     else
+          if(exists(upper+"/"+path))
+          {
+               remember(path,layer_cache::UPPER);
+               return upper+"/"+path;
+          }
+          else if(exists(lower+"/"+path))
+          {
+               remember(path,layer_cache::LOWER);
+               return lower+"/"+path;
+          }
+     
+     remember(path,layer_cache::ABSENT);
+     return upper+"/"+path;
+}
+
+static string handle_read(const char* path)
+{
+     wuutkl(path);
+     return resolve(path);
+}
+
+static void add_pending_commit(const char* path)
+{
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     pending_luc.cancel(path);
+     queue_commit(path);
+     plocklib_release_simple_lock(&pending_commits_lock);
+}
+
+//Like add_pending_commit, for a change to [start,end) of path.
+static void add_dirty_commit(const char* path, off_t start, off_t end)
+{
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     commit_states[path].dirty.add(start,end);
+     pending_luc.cancel(path);
+     queue_commit(path);
+     plocklib_release_simple_lock(&pending_commits_lock);
+}
+
+static string handle_write(const char* path)
+{
+     wuutkl(path);
+     
+     if(two_way)
+          resolve(path);
+
+     if(exists(upper+"/"+path) && !special(upper+"/"+path))
+     {
+          add_pending_commit(path);
+          return upper+"/"+path;
+     }
+     else if(exists(upper+"/"+path))
+          return upper+"/"+path;
+     
+     string lpath = lower+"/"+string{path}.substr(0,string{path}.rfind("/"));
+     int res = 0;
+     if(exists(lpath))
+     {
+          res = copylib_mkdirs(lower_fd,upper_fd,copylib_parent(path));
+          if(!res)
+               remember_upper_dirs(copylib_parent(path));
+          if(!res && exists(lower+"/"+path))
+          {
+               resign(path);
+               freeze(path);
+               //Someone else may have copied it up while we waited.
+               if(!exists(upper+"/"+path))
+               {
+                    //Big files are fetched a chunk at a time
+                    //instead, falling back to a full copy if upper
+                    //can't keep track of the chunks.
+                    struct stat st;
+                    res = -1;
+                    if(config.lazy_copy && !fstatat(lower_fd,copylib_relative(path).c_str(),&st,AT_SYMLINK_NOFOLLOW) &&
+                       S_ISREG(st.st_mode) && st.st_size >= (off_t)config.lazy_copy)
+                         res = lazy_copy_up(path);
+                    bool lazy = !res;
+                    if(res)
+                    {
+                         op_timer timer(OP_COPY_UP);
+                         res = copylib_copy(lower_fd,upper_fd,path);
+                    }
+                    if(!res)
+                         copied_up(path,lazy);
+               }
+               if(!res)
+               {
+                    rebind_open_files(path,upper+"/"+path,true);
+                    remember(path,layer_cache::UPPER);
+               }
+               thaw_and_keep(path);
+          }
+     }
+     else
+          return upper+"/"+path;
+
+     //Copy-up failed: the caller still holds path, but gets an empty
+     //name and errno.
+     if(res)
+     {
+          errno = -res;
+          return "";
+     }
+     
+     add_pending_commit(path);
+     return upper+"/"+path;
+}
+
+/*Everything /.tefs/stats shows, as text or JSON: the timings and
+  counters in stats, then the state of the queues and caches.*/
+static string stats_text(bool json)
+{
+     auto reading = stats.read();
+
+     vector<pair<string,string>> values;
+     auto add = [&](const string& name, double value)
+          {
+               ostringstream out;
+               out.precision(value==(uint64_t)value ? 0 : 1);
+               out << fixed << value;
+               values.emplace_back(name,out.str());
+          };
+     for(size_t i=0; i<reading.counters.size(); i++)
+          add(stats.counter_names[i],reading.counters[i]);
+
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     time_t now = time(NULL);
+     add("pending_commits",pending_commits.size());
+     add("urgent_commits",urgent_commits.size());
+     add("pending_luc",pending_luc.size());
+     add("pending_attrs",attr_changes.size());
+     add("commits_in_flight",commits_in_flight);
+     add("urgent_in_flight",urgent_in_flight);
+     add("commit_window",commit_window);
+     //How far behind the most overdue commit is.
+     add("commit_lag_s",pending_commits.empty() ? 0 : max<time_t>(0,now-pending_commits.next_due()));
+     plocklib_release_simple_lock(&pending_commits_lock);
+
+     add("batches",batch_stats.batches);
+     add("batched_files",batch_stats.files);
+     add("evicted_files",evicted_files);
+     add("evicted_bytes",evicted_bytes);
+     auto cache = [&](const string& name, unsigned long hits, unsigned long misses)
+          {
+               add(name+"_hits",hits);
+               add(name+"_misses",misses);
+               add(name+"_hit_pct",hits+misses ? 100.0*hits/(hits+misses) : 0);
+          };
+     cache("upper",upper_hits,upper_misses);
+     cache("layer_cache",layers.hits,layers.misses);
+     cache("dir_cache",listings.hits,listings.misses);
+     cache("block_cache",blocks.hits,blocks.misses);
+
+     ostringstream out;
+     if(json)
+     {
+          out << "{\n  \"ops\": {";
+          for(size_t i=0; i<reading.ops.size(); i++)
+          {
+               const auto& h = reading.ops[i];
+               out << (i ? "," : "") << "\n    \"" << stats.op_names[i] << "\": {\"count\": " << h.count
+                   << ", \"total_us\": " << h.total_us << ", \"p50_us\": " << h.percentile_us(0.5)
+                   << ", \"p99_us\": " << h.percentile_us(0.99) << ", \"buckets\": [";
+               for(unsigned b=0; b<metrics::BUCKETS; b++)
+                    out << (b ? ", " : "") << h.buckets[b];
+               out << "]}";
+          }
+          out << "\n  }";
+          for(const auto& x : values)
+               out << ",\n  \"" << x.first << "\": " << x.second;
+          out << "\n}\n";
+     }
+     else
+     {
+          out << "op            count   avg_us   p50_us   p99_us\n";
+          for(size_t i=0; i<reading.ops.size(); i++)
+          {
+               const auto& h = reading.ops[i];
+               if(!h.count)
+                    continue;
+               char line[128];
+               snprintf(line,sizeof(line),"%-10s %8lu %8lu %8lu %8lu\n",stats.op_names[i].c_str(),
+                        (unsigned long)h.count,(unsigned long)(h.total_us/h.count),
+                        (unsigned long)h.percentile_us(0.5),(unsigned long)h.percentile_us(0.99));
+               out << line;
+          }
+          out << "\n";
+          for(const auto& x : values)
+               out << x.first << " " << x.second << "\n";
+     }
+     return out.str();
+}
+
+/*Inside the mount, /.tefs is only the stats files: stats and
+  stats.json.  The percentiles are the upper ends of power-of-two
+  buckets.*/
+static int stats_getattr(const char* path, struct stat* stbuf)
+{
+     memset(stbuf,0,sizeof(*stbuf));
+     stbuf->st_uid = getuid();
+     stbuf->st_gid = getgid();
+     stbuf->st_mtim.tv_sec = time(NULL);
+     stbuf->st_ctim = stbuf->st_atim = stbuf->st_mtim;
+     if(!strcmp(path,"/.tefs"))
+     {
+          stbuf->st_mode = S_IFDIR | 0111;
+          stbuf->st_nlink = 2;
+          return 0;
+     }
+     if(!strcmp(path,"/.tefs/stats") || !strcmp(path,"/.tefs/stats.json"))
+     {
+          stbuf->st_mode = S_IFREG | 0444;
+          stbuf->st_nlink = 1;
+          return 0;
+     }
+     return -ENOENT;
+}
+
+/*Open a stats file: it's written out once, to a memfd, so it doesn't
+  change while it's read.  Its size is unknown beforehand, so it's
+  opened for direct I/O, which reads it up to EOF whatever getattr
+  said.*/
+static int open_stats(const char* path, struct fuse_file_info* fi)
+{
+     bool json = !strcmp(path,"/.tefs/stats.json");
+     if(!json && strcmp(path,"/.tefs/stats"))
+          return -ENOENT;
+     if((fi->flags & O_ACCMODE) != O_RDONLY)
+          return -EACCES;
+
+     string text = stats_text(json);
+     int fd = memfd_create("tefs-stats",0);
+     if(fd==-1)
+          return -errno;
+     if(write(fd,text.data(),text.size())!=(ssize_t)text.size())
+     {
+          close(fd);
+          return -EIO;
+     }
+     //No path: reads go straight to the memfd, like those of unlinked
+     //files.
+     fi->fh = (uint64_t) new open_file{fd,O_RDONLY,"",false,0};
+     fi->direct_io = 1;
+     return 0;
+}
+
+static int tefs_getattr(const char *path, struct stat *stbuf)
+{
+     if(reserved(path))
+          return stats_getattr(path, stbuf);
+
+     string fname = handle_read(path);
+     
+     int res;
+     res = lstat(fname.c_str(), stbuf);
+     resign(path);
+     if (res == -1)
+     {
+          res = -errno;
+          //The kernel had this name, so it went from lower behind its
+          //back: don't let it keep handing out the dead entry.
+          if (res == -ENOENT)
+               invalidate(path, false, true);
+          return res;
+     }
+
+     queued_attrs(path, stbuf);
+     return 0;
+}
+
+static int tefs_access(const char *path, int mask)
+{
+     struct stat st;
+     if(reserved(path))
+          return stats_getattr(path, &st) ? -ENOENT : (mask & W_OK) ? -EACCES : 0;
+
+     string fname = handle_read(path);
+     
+     int res;
+     res = access(fname.c_str(), mask);
+     resign(path);
+     if (res == -1)
+          return -errno;
+
+     return 0;
+}
+
+static int tefs_readlink(const char *path, char *buf, size_t size)
+{
+     if(reserved(path))
+          return -ENOENT;
+
+     string fname = handle_read(path);
+     
+     int res;
+     res = readlink(fname.c_str(), buf, size - 1);
+     resign(path);
+     if (res == -1)
+          return -errno;
+
+     buf[res] = '\0';
+     return 0;
+}
+
+/*An open directory.  Its listing is streamed rather than read up
+  front: the upper directory's names first, then the names only lower
+  has, each checked against upper as it's read.  Nothing the size of
+  the directory is held, except a copy of the listing for listings
+  when it's small enough to be worth keeping.
+
+  Offsets are positions in that sequence.  Reading on from where the
+  last readdir stopped just carries on; any other offset starts again
+  from the top and skips ahead, which costs the skipped names but
+  keeps offsets stable for as long as the directory doesn't change.*/
+struct open_dir
+{
+     string path;
+     int ufd = -1;             //the directory in each layer, for
+     int lfd = -1;             //fstatat; -1 if not there
+     DIR* streams[2] = {NULL,NULL};    //upper then lower, or just lower
+     int current = 0;          //index into streams; 2 at the end
+     off_t position = 0;       //of pending
+     bool held = false;        //pending is read but not yet returned
+     dir_cache::entry pending;
+     shared_ptr<const dir_cache::listing> cached;   //reading from this instead
+     shared_ptr<dir_cache::listing> building;       //copy for listings
+     uint64_t generation = 0;
+};
+
+static void close_dir(open_dir* od)
+{
+     for(auto dp : od->streams)
+          if(dp)
+               closedir(dp);
+     if(od->ufd!=-1)
+          close(od->ufd);
+     if(od->lfd!=-1)
+          close(od->lfd);
+     delete od;
+}
+
+//Start od's listing again from the top.
+static int restart_dir(open_dir* od)
+{
+     od->current = 0;
+     od->position = 0;
+     od->held = false;
+     if(od->cached)
+          return 0;
+
+     od->generation = listings.generation();
+     od->building = listings.get_capacity() ? make_shared<dir_cache::listing>() : nullptr;
+     int fds[2] = {od->ufd,od->lfd};
+     for(int i=0; i<2; i++)
+     {
+          if(od->streams[i])
+          {
+               rewinddir(od->streams[i]);
+               continue;
+          }
+          int fd = fds[i]==-1 ? -1 : dup(fds[i]);
+          if(fd!=-1 && !(od->streams[i] = fdopendir(fd)))
+          {
+               close(fd);
+               return -errno;
+          }
+     }
+     //Only one layer: nothing to merge.
+     if(!od->streams[0])
+          od->current = 1;
+     return 0;
+}
+
+//Read the next name of od's listing into od->pending.  Returns false
+//at the end.
+static bool next_entry(open_dir* od)
+{
+     if(od->held)
+          return true;
+     if(od->cached)
+     {
+          if(od->position >= (off_t)od->cached->size())
+               return false;
+          od->pending = (*od->cached)[od->position];
+          return od->held = true;
+     }
+
+     while(od->current < 2)
+     {
+          struct dirent* de = od->streams[od->current] ? readdir(od->streams[od->current]) : NULL;
+          if(!de)
+          {
+               od->current++;
+               continue;
+          }
+          if(!strncmp(de->d_name,".tefs-copy.",11) || (od->path=="/" && !strcmp(de->d_name,".tefs")))
+               continue;
+          //Names upper has too were listed from upper already.
+          struct stat st;
+          if(od->current==1 && od->ufd!=-1 && !fstatat(od->ufd,de->d_name,&st,AT_SYMLINK_NOFOLLOW))
+               continue;
+
+          od->pending = {de->d_name,de->d_type};
+          if(od->building)
+          {
+               if(od->building->size() < listings.get_capacity())
+                    od->building->push_back(od->pending);
+               else
+                    od->building.reset();
+          }
+          return od->held = true;
+     }
+
+     //Got to the end without skipping anything: keep it.
+     if(od->building)
+     {
+          listings.set(od->path,od->building,od->generation,two_way ? config.layer_ttl : 0);
+          od->building.reset();
+     }
+     return false;
+}
+
+//Move od to offset, which readdir was asked to start from.
+static void seek_dir(open_dir* od, off_t offset)
+{
+     if(offset==od->position)
+          return;
+     if(offset < od->position || od->cached)
+     {
+          if(restart_dir(od))
+               return;
+          if(od->cached)
+          {
+               od->position = offset;
+               return;
+          }
+     }
+     //Anything but a read of the whole thing in order isn't kept.
+     if(offset)
+          od->building.reset();
+     while(od->position < offset && next_entry(od))
+     {
+          od->held = false;
+          od->position++;
+     }
+}
+
+/*Attributes of name in od's directory, as a getattr of it would find
+  them, but without its side effects: nothing gets queued to copy up
+  just for being listed.*/
+static bool entry_attr(open_dir* od, const string& name, struct stat* st)
+{
+     struct stat lst;
+     bool in_upper = od->ufd!=-1 && !fstatat(od->ufd,name.c_str(),st,AT_SYMLINK_NOFOLLOW);
+     if(in_upper && !two_way)
+          return true;
+     bool in_lower = od->lfd!=-1 && !fstatat(od->lfd,name.c_str(),&lst,AT_SYMLINK_NOFOLLOW);
+     if(in_lower && (!in_upper || lst.st_mtime > st->st_mtime))
+          *st = lst;
+     if(in_upper || in_lower)
+          queued_attrs(od->path=="/" ? "/"+name : od->path+"/"+name,st);
+     return in_upper || in_lower;
+}
+
+//Open path's listing.
+static int tefs_opendir(const char *path, open_dir* od)
+{
+     if(reserved(path))
+          return -ENOENT;
+
+     string fname = handle_read(path);
+     int res = 0;
+     od->path = path;
+     if(is_upper(fname))
+     {
+          od->ufd = openat(upper_fd,copylib_relative(path).c_str(),O_RDONLY | O_DIRECTORY);
+          if(od->ufd==-1)
+               res = -errno;
+     }
+     if(!res)
+     {
+          od->lfd = openat(lower_fd,copylib_relative(path).c_str(),O_RDONLY | O_DIRECTORY);
+          if(od->lfd==-1 && od->ufd==-1)
+               res = -errno;
+     }
+     resign(path);
+
+     if(!res)
+     {
+          od->cached = listings.lookup(path);
+          res = restart_dir(od);
+     }
+     return res;
+}
+
+static int tefs_mknod(const char *path, mode_t mode, dev_t rdev)
+{
+     if(reserved(path))
+          return -EPERM;
+
+     mode |= S_IRUSR | S_IWUSR;
+     
+     string fname;
+     if(S_ISREG(mode))
+          fname = handle_write(path);
+     else
+     {
+          wuutkl(path);
+          fname = upper+"/"+path;
+     }
+     if(fname.empty())
+     {
+          resign(path);
+          return -errno;
+     }
+     
+     int res;
+
+     /* On Linux this could just be 'mknod(path, mode, rdev)' but this
+        is more portable */
+     if (S_ISREG(mode)) {
+          res = open(fname.c_str(), O_CREAT | O_EXCL | O_WRONLY, mode);
+          if (res >= 0)
+               res = close(res);
+     } else if (S_ISFIFO(mode))
+          res = mkfifo(fname.c_str(), mode);
+     else
+          res = mknod(fname.c_str(), mode, rdev);
+     if (res != -1)
+     {
+          remember(path,layer_cache::UPPER);
+          listing_changed(path);
+     }
+
+     resign(path);
+     if (res == -1)
+          return -errno;
+
+     return 0;
+}
+
+static int tefs_mkdir(const char *path, mode_t mode)
+{
+     if(reserved(path))
+          return -EPERM;
+
+     mode |= S_IRUSR | S_IWUSR;
+
+     string fname = handle_write(path);
+     if(fname.empty())
+     {
+          resign(path);
+          return -errno;
+     }
+     int res;
+
+     res = mkdir(fname.c_str(), mode);
+     mkdir((lower+"/"+path).c_str(),mode);
+     if (res != -1)
+     {
+          remember(path,layer_cache::UPPER);
+          listing_changed(path);
+     }
+
+     resign(path);
+     if (res == -1)
+          return -errno;
+
+     return 0;
+}
+
+static int tefs_unlink(const char *path)
+{
+     if(reserved(path))
+          return -ENOENT;
+
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     cancel_queued(path);
+     lock_commit_paths({path});
+     plocklib_release_simple_lock(&pending_commits_lock);
+     wuutkl(path);
+     
+     int res;
+     res = unlink((lower+"/"+path).c_str());
+     res = unlink((upper+"/"+path).c_str())==-1 ? res : 0;
+     if(res!=-1)
+     {
+          forget_open_files(path);
+          forget_partial(path);
+          remember(path,layer_cache::ABSENT);
+          listing_changed(path);
+          plocklib_acquire_simple_lock(&space_lock);
+          last_used.erase(path);
+          plocklib_release_simple_lock(&space_lock);
+     }
+
+     resign(path);
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     if(res!=-1)
+          commit_states.erase(path);
+     unlock_commit_paths({path});
+     plocklib_release_simple_lock(&pending_commits_lock);
+     if (res == -1)
+          return -errno;
+
+     return 0;
+}
+
+static int tefs_rmdir(const char *path)
+{
+     if(reserved(path))
+          return -ENOENT;
+
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     cancel_queued(path);
+     lock_commit_paths({path});
+     plocklib_release_simple_lock(&pending_commits_lock);
+     wuutkl(path);
+
+     int res;
+     res = rmdir((lower+"/"+path).c_str());
+     res = rmdir((upper+"/"+path).c_str())==-1 ? res : 0;
+     if(res!=-1)
+     {
+          remember(path,layer_cache::ABSENT);
+          listing_changed(path);
+          listings.erase_tree(path);
+     }
+
+     resign(path);
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     unlock_commit_paths({path});
+     plocklib_release_simple_lock(&pending_commits_lock);
+     if (res == -1)
+          return -errno;
+
+     return 0;
+}
+
+static int tefs_symlink(const char *from, const char *to)
+{
+     if(reserved(to))
+          return -EPERM;
+
+     string fname = handle_write(to);
+     if(fname.empty())
+     {
+          resign(to);
+          return -errno;
+     }
+     int res;
+
+     res = symlink(from, fname.c_str());
+     if (res != -1)
+     {
+          remember(to,layer_cache::UPPER);
+          listing_changed(to);
+     }
+     resign(to);
+     if (res == -1)
+          return -errno;
+     
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     queue_commit(to);
+     plocklib_release_simple_lock(&pending_commits_lock);
+     return 0;
+}
+
+//Is dir in the layer under root empty?
+static bool empty_dir(int root, const string& dir)
+{
+     int fd = openat(root,copylib_relative(dir).c_str(),O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+     if(fd==-1)
+          return false;
+     DIR* dp = fdopendir(fd);
+     if(!dp)
+     {
+          close(fd);
+          return false;
+     }
+     bool empty = true;
+     struct dirent* de;
+     while(empty && (de = readdir(dp)))
+          empty = !strcmp(de->d_name,".") || !strcmp(de->d_name,"..");
+     closedir(dp);
+     return empty;
+}
+
+/*Rename from to to in each layer from is in, and move everything we
+  keep about it along.  No data moves: lower's copy keeps the inode,
+  size and mtime the commit states and fingerprints describe, so
+  whatever was queued for from is committed to to as it would have
+  been.  Whatever to was is removed from a layer from isn't in.*/
+static int tefs_rename(const char *from, const char *to)
+{
+     if(reserved(from) || reserved(to))
+          return -EPERM;
+
+     //Make sure lower is current for both names.
+     handle_read(from);
+     resign(from);
+     handle_read(to);
+     resign(to);
+
+     //Keep commits away from both names (and, for directories,
+     //everything under them) until the rename is done.
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     lock_commit_paths({from,to});
+     plocklib_release_simple_lock(&pending_commits_lock);
+
+     //Freezing a directory waits for everything under it too.
+     plocklib_path_set frozen;
+     plocklib_path_set_add(frozen,from,PLOCKLIB_X);
+     plocklib_path_set_add(frozen,to,PLOCKLIB_X);
+     plocklib_lock_paths(&path_locks,frozen);
+
+     string frel = copylib_relative(from), trel = copylib_relative(to);
+     struct stat ust, lst, tust, tlst;
+     bool in_upper = !fstatat(upper_fd,frel.c_str(),&ust,AT_SYMLINK_NOFOLLOW);
+     bool in_lower = !fstatat(lower_fd,frel.c_str(),&lst,AT_SYMLINK_NOFOLLOW);
+     bool to_upper = !fstatat(upper_fd,trel.c_str(),&tust,AT_SYMLINK_NOFOLLOW);
+     bool to_lower = !fstatat(lower_fd,trel.c_str(),&tlst,AT_SYMLINK_NOFOLLOW);
+     bool dir = in_upper ? S_ISDIR(ust.st_mode) : S_ISDIR(lst.st_mode);
+
+     int res = 0;
+     if(!in_upper && !in_lower)
+          res = -ENOENT;
+     //Check to against from before changing anything: in the layers
+     //the renames below don't touch, and in upper, where to is swapped
+     //rather than replaced.
+     else if(strcmp(from,to))
+          for(auto x : {make_pair(to_upper,&tust), make_pair(to_lower,&tlst)})
+          {
+               if(!x.first)
+                    continue;
+               if(dir && !S_ISDIR(x.second->st_mode))
+                    res = -ENOTDIR;
+               else if(!dir && S_ISDIR(x.second->st_mode))
+                    res = -EISDIR;
+               else if(dir && !empty_dir(x.second==&tust ? upper_fd : lower_fd,to))
+                    res = -ENOTEMPTY;
+          }
+
+     if(!res && in_lower)
+          res = copylib_mkdirs(upper_fd,lower_fd,copylib_parent(to));
+     if(!res && in_upper)
+     {
+          res = copylib_mkdirs(lower_fd,upper_fd,copylib_parent(to));
+          if(!res)
+               remember_upper_dirs(copylib_parent(to));
+     }
+
+     /*Upper goes first, and keeps its old to at from's name, so that
+       if lower then fails, upper can be put back as it was.  Lower,
+       which may not be able to swap names, goes last and only has to
+       be right or untouched.  Two names for one file aren't swapped:
+       the rename leaves both.*/
+     bool swapped = false;
+     if(!res && in_upper)
+     {
+          swapped = to_upper && strcmp(from,to) && (tust.st_dev!=ust.st_dev || tust.st_ino!=ust.st_ino);
+          if(swapped ? renameat2(upper_fd,frel.c_str(),upper_fd,trel.c_str(),RENAME_EXCHANGE)==-1 :
+             renameat(upper_fd,frel.c_str(),upper_fd,trel.c_str())==-1)
+               res = -errno;
+          if(!res && in_lower && renameat(lower_fd,frel.c_str(),lower_fd,trel.c_str())==-1)
+          {
+               res = -errno;
+               if(swapped)
+                    renameat2(upper_fd,frel.c_str(),upper_fd,trel.c_str(),RENAME_EXCHANGE);
+               else
+                    renameat(upper_fd,trel.c_str(),upper_fd,frel.c_str());
+          }
+          //Upper's old to, checked above to be empty if a directory.
+          else if(!res && swapped)
+               unlinkat(upper_fd,frel.c_str(),dir ? AT_REMOVEDIR : 0);
+     }
+     else if(!res && in_lower)
+     {
+          //Upper's old to would hide what lower renames over it, so
+          //it goes somewhere listings don't show first, and comes back
+          //if lower can't rename.
+          string aside;
+          if(to_upper && strcmp(from,to))
+          {
+               aside = copylib_temp_name(trel);
+               if(renameat(upper_fd,trel.c_str(),upper_fd,aside.c_str())==-1)
+                    res = -errno;
+          }
+          if(!res && renameat(lower_fd,frel.c_str(),lower_fd,trel.c_str())==-1)
+          {
+               res = -errno;
+               if(aside.size())
+                    renameat(upper_fd,aside.c_str(),upper_fd,trel.c_str());
+          }
+          if(!res && aside.size() && unlinkat(upper_fd,aside.c_str(),dir ? AT_REMOVEDIR : 0)==-1)
+               cerr << "Removing the old " << to << " from upper failed: " << strerror(errno) << endl;
+     }
+     if(!res && strcmp(from,to))
+     {
+          //Lower's old to only shows through once upper's copy goes,
+          //but that mustn't bring it back.
+          int stale = 0;
+          if(to_lower && !in_lower && unlinkat(lower_fd,trel.c_str(),dir ? AT_REMOVEDIR : 0)==-1)
+          {
+               stale = -errno;
+               cerr << "Removing the old " << to << " from lower failed: " << strerror(-stale) << endl;
+               stats.count(COMMIT_ERRORS);
+          }
+
+          forget_open_files(to);
+          forget_partial(to);
+          rename_open_files(from,to);
+          rename_partial(from,to);
+
+          plocklib_acquire_simple_lock(&pending_commits_lock);
+          cancel_queued(to);
+          pending_commits.rename(from,to);
+          urgent_commits.rename(from,to);
+          pending_luc.rename(from,to);
+          journal.append('R',from,to);
+          attr_changes.rename(from,to);
+          attrs_queued = attr_changes.size();
+          rename_commit_states(from,to);
+          //Committing to writes over lower's old one.  An old directory
+          //was empty, and only merges with the new one.
+          if(stale && !dir)
+               queue_commit(to,true);
+          plocklib_release_simple_lock(&pending_commits_lock);
+
+          plocklib_acquire_simple_lock(&space_lock);
+          extract_tree(last_used,to);
+          rename_tree(last_used,from,to);
+          plocklib_release_simple_lock(&space_lock);
+     }
+     layers.erase_tree(from);
+     layers.erase_tree(to);
+     listing_changed(from);
+     listing_changed(to);
+     listings.erase_tree(from);
+     listings.erase_tree(to);
+
+     plocklib_unlock_paths(&path_locks,frozen);
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     unlock_commit_paths({from,to});
+     plocklib_release_simple_lock(&pending_commits_lock);
+     if(res)
+          return res;
+
+     invalidate(to);
+     return 0;
+}
+
+/*Make change in upper now, if path is there, and queue it for lower,
+  where attrs_thread makes it; getattr and the xattr calls show it from
+  the queue until then.  A path that is only in upper needs nothing
+  queued, as its commit takes upper's attributes along, unless that
+  commit is already running.*/
+static int change_attrs(const char* path, attr_change change)
+{
+     if(reserved(path))
+          return -ENOENT;
+
+     wuutkl(path);
+     //Both layers get the same times.
+     change.resolve_now();
+     string rel = copylib_relative(path);
+     struct stat st;
+     int res = 0;
+     bool in_upper = !fstatat(upper_fd,rel.c_str(),&st,AT_SYMLINK_NOFOLLOW);
+     if(in_upper && (res = change.apply(upper_fd,rel)))
+     {
+          resign(path);
+          return res;
+     }
+     //chown may have cleared setuid bits; lower's copy loses them too.
+     if(in_upper && (change.uid!=(uid_t) -1 || change.gid!=(gid_t) -1) &&
+        !fstatat(upper_fd,rel.c_str(),&st,AT_SYMLINK_NOFOLLOW) && !S_ISLNK(st.st_mode))
+     {
+          change.set_mode = true;
+          change.mode = st.st_mode & 07777;
+     }
+
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     bool busy = commit_busy(path);
+     plocklib_release_simple_lock(&pending_commits_lock);
+     bool in_lower = !fstatat(lower_fd,rel.c_str(),&st,AT_SYMLINK_NOFOLLOW);
+     if(!in_upper && !in_lower)
+          res = -ENOENT;
+     else if(in_lower || busy)
+     {
+          plocklib_acquire_simple_lock(&pending_commits_lock);
+          if(attr_changes.push(path,change))
+               stats.count(ATTRS_COALESCED);
+          attrs_queued = attr_changes.size();
+          pthread_cond_signal(&attrs_cond);
+          plocklib_release_simple_lock(&pending_commits_lock);
+     }
+
+     resign(path);
+     return res;
+}
+
+static int tefs_chmod(const char *path, mode_t mode)
+{
+     attr_change change;
+     change.set_mode = true;
+     change.mode = mode | S_IRUSR | S_IWUSR;
+     return change_attrs(path, change);
+}
+
+static int tefs_chown(const char *path, uid_t uid, gid_t gid)
+{
+     attr_change change;
+     change.uid = uid;
+     change.gid = gid;
+     return change_attrs(path, change);
+}
+
+static int tefs_truncate(const char *path, off_t size)
+{
+     if(reserved(path))
+          return -ENOENT;
+
+     string fname = handle_write(path);
+     if(fname.empty())
+     {
+          resign(path);
+          return -errno;
+     }
+     int res;
+
+     auto pf = find_partial(path);
+     if(pf)
+     {
+          plocklib_acquire_simple_lock(&pf->lock);
+          res = prepare_partial_truncate(*pf,size);
+          if(!res)
+               res = truncate(fname.c_str(), size);
+          else
+          {
+               errno = -res;
+               res = -1;
+          }
+          plocklib_release_simple_lock(&pf->lock);
+     }
+     else
+          res = truncate(fname.c_str(), size);
+     resign(path);
+     if (res == -1)
+          return -errno;
+
+     //Everything past size is gone, and reads as zeros if the file
+     //grows again.
+     add_dirty_commit(path,size,numeric_limits<off_t>::max());
+
+     return 0;
+}
+
+static int tefs_utimens(const char *path, const struct timespec ts[2])
 {
-     return !faccessat(AT_FDCWD,path.c_str(),F_OK,AT_SYMLINK_NOFOLLOW);
+     attr_change change;
+     change.times[0] = ts[0];
+     change.times[1] = ts[1];
+     return change_attrs(path, change);
 }
 
-static bool special(string path)
+static bool private_xattr(const char* name)
 {
-     struct stat buf;
-     lstat(path.c_str(),&buf);
-     return ! (S_ISREG(buf.st_mode) || S_ISLNK(buf.st_mode));
+     return !strncmp(name,COPYLIB_PRIVATE_XATTRS,strlen(COPYLIB_PRIVATE_XATTRS));
 }
 
-void* commits_thread(void* ignored)
+//Returns the size of name's value, or -errno.
+static ssize_t tefs_getxattr(const char *path, const char *name, char *value, size_t size)
 {
-     while(true)
+     if(reserved(path) || private_xattr(name))
+          return -ENODATA;
+
+     //Queued changes are newer than either layer.
+     if(attrs_queued)
      {
-          sleep(5);
-          plocklib_become_reader(&frozen_files_lock);
+          optional<string> queued;
+          bool found = false;
           plocklib_acquire_simple_lock(&pending_commits_lock);
-          //cout << "Pending commits: " << pending_commits.size() << endl;
-          //for(const auto& x : pending_commits)
-          //     cout << x.first << " / " << x.second << endl;
-          while(pending_commits.size())
+          auto change = attr_changes.find(path);
+          if(change && change->xattrs.count(name))
           {
-               const auto entry = pending_commits.front();
-               if(!frozen_files.count(entry.first) && time(NULL) >= entry.second)
-               {
-                    pending_commits.pop_front();
-                    if(entry.first.find(".fuse_hidden")!=-1 || !exists(upper+"/"+entry.first) || special(upper+"/"+entry.first))
-                         continue;
-                    plocklib_release_simple_lock(&pending_commits_lock);
-
-                    plocklib_acquire_simple_lock(&active_commits_lock);
-                    string rpath = lower+"/"+entry.first.substr(0,entry.first.rfind("/"));
-                    auto child_pid = fork();
-                    if(!child_pid)
-                         execlp("mkdir","mkdir","-p",rpath.c_str(),NULL);
-                    else
-                         waitpid(child_pid,NULL,0);
-                    child_pid = fork();
-                    if(!child_pid)
-                         execlp("cp","cp","-a",(upper+"/"+entry.first).c_str(),rpath.c_str(),NULL);
-                    else
-                         waitpid(child_pid,NULL,0);
-                    plocklib_release_simple_lock(&active_commits_lock);
-
-                    //We can't just hold the frozen files lock as a reader forever.
-                    if(!flush_time)
-                    {                         
-                         plocklib_resign_as_reader(&frozen_files_lock);
-                         sleep(5);
-                         plocklib_become_reader(&frozen_files_lock);
-                    }
-                    plocklib_acquire_simple_lock(&pending_commits_lock);
-               }
-               else
-                    break;
+               found = true;
+               queued = change->xattrs.at(name);
           }
           plocklib_release_simple_lock(&pending_commits_lock);
-          plocklib_resign_as_reader(&frozen_files_lock);
+          if(found)
+          {
+               if(!queued)
+                    return -ENODATA;
+               if(!size)
+                    return queued->size();
+               if(size < queued->size())
+                    return -ERANGE;
+               memcpy(value, queued->data(), queued->size());
+               return queued->size();
+          }
      }
+
+     string fname = handle_read(path);
+     ssize_t res = lgetxattr(fname.c_str(), name, value, size);
+     if (res == -1)
+          res = -errno;
+     resign(path);
+     return res;
 }
 
-void* luc_thread(void* ignored)
+//Returns the size of the list, or -errno.
+static ssize_t tefs_listxattr(const char *path, char *list, size_t size)
 {
-     while(true)
+     if(reserved(path))
+          return 0;
+
+     string fname = handle_read(path);
+     vector<char> buf;
+     ssize_t len = llistxattr(fname.c_str(), NULL, 0);
+     if (len > 0)
+     {
+          buf.resize(len);
+          len = llistxattr(fname.c_str(), buf.data(), buf.size());
+     }
+     if (len == -1)
+          len = -errno;
+     resign(path);
+     if (len < 0)
+          return len;
+
+     vector<string> names;
+     for(ssize_t i=0; i<len; i+=strlen(&buf[i])+1)
+          if(!private_xattr(&buf[i]))
+               names.push_back(&buf[i]);
+     if(attrs_queued)
      {
-          sleep(5);
-          plocklib_become_reader(&frozen_files_lock);
           plocklib_acquire_simple_lock(&pending_commits_lock);
-          bool reader = true;
-          while(pending_luc.size())
-          {
-               const auto entry = pending_luc.front();
-               if(!frozen_files.count(entry.first) && time(NULL) >= entry.second)
+          auto change = attr_changes.find(path);
+          if(change)
+               for(const auto& x : change->xattrs)
                {
-                    string rpath = upper+"/"+entry.first.substr(0,entry.first.rfind("/"));
-                    while(!plocklib_request_writer_promotion(&frozen_files_lock))
-                         plocklib_become_reader(&frozen_files_lock);
-                    frozen_files.insert(entry.first.substr(0,entry.first.rfind("/")));
-                    frozen_files.insert(entry.first);
-                    pending_luc.pop_front();
-                    plocklib_release_simple_lock(&pending_commits_lock);
-                    plocklib_resign_as_writer(&frozen_files_lock);
-                    auto child_pid = fork();
-                    if(!child_pid)
-                         execlp("mkdir","mkdir","-p",rpath.c_str(),NULL);
-                    else
-                         waitpid(child_pid,NULL,0);
-                    child_pid = fork();
-                    if(!child_pid)
-                         execlp("cp","cp","-a",(lower+"/"+entry.first).c_str(),rpath.c_str(),NULL);
-                    else
-                         waitpid(child_pid,NULL,0);
-                    plocklib_become_reader(&frozen_files_lock);
-                    while(!plocklib_request_writer_promotion(&frozen_files_lock))
-                         plocklib_become_reader(&frozen_files_lock);
-
-                    plocklib_acquire_simple_lock(&pending_commits_lock);
-                    frozen_files.erase(entry.first);
-                    frozen_files.erase(entry.first.substr(0,entry.first.rfind("/")));
-                    plocklib_resign_as_writer(&frozen_files_lock);
-                    reader = false;
+                    names.erase(remove(names.begin(),names.end(),x.first),names.end());
+                    if(x.second)
+                         names.push_back(x.first);
                }
-               else
-                    break;
-          }
           plocklib_release_simple_lock(&pending_commits_lock);
-          if(reader)
-               plocklib_resign_as_reader(&frozen_files_lock);
      }
+
+     string joined;
+     for(const auto& x : names)
+          joined.append(x.c_str(),x.size()+1);
+     if(!size)
+          return joined.size();
+     if(size < joined.size())
+          return -ERANGE;
+     memcpy(list, joined.data(), joined.size());
+     return joined.size();
 }
 
-//wait until unfrozen then keep lock
-static void wuutkl(function<bool()>& predicate)
+static int tefs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
 {
-     //Check if file is frozen
-     plocklib_become_reader(&frozen_files_lock);
-     bool is_frozen = false;
-     is_frozen = predicate();
-     while(is_frozen)
+     if(private_xattr(name))
+          return -EPERM;
+
+     if(flags)
      {
-          plocklib_resign_as_reader(&frozen_files_lock);
-          usleep((int)(SLEEPY_TIME*1000000));
-          plocklib_become_reader(&frozen_files_lock);
-          is_frozen = predicate();
+          ssize_t res = tefs_getxattr(path, name, NULL, 0);
+          if(res < 0 && res != -ENODATA)
+               return res;
+          if((flags & XATTR_CREATE) && res >= 0)
+               return -EEXIST;
+          if((flags & XATTR_REPLACE) && res < 0)
+               return -ENODATA;
      }
+     attr_change change;
+     change.xattrs[name] = string(value, size);
+     return change_attrs(path, change);
 }
 
-//wait until unfrozen then keep lock
-static void wuutkl(const char* path)
+static int tefs_removexattr(const char *path, const char *name)
 {
-     function<bool()> pred = [&]() { return frozen_files.count(path); };
-     wuutkl(pred);
+     ssize_t res = tefs_getxattr(path, name, NULL, 0);
+     if(res < 0)
+          return res;
+     attr_change change;
+     change.xattrs[name] = nullopt;
+     return change_attrs(path, change);
 }
 
-//wait until unfrozen then keep lock
-static void wuutkl(initializer_list<const char*> paths)
+//Open fname, which path resolved to, and set fi->fh.  Called with
+//path held; lets go of it.
+static int open_resolved(const char *path, const string& fname, mode_t mode, struct fuse_file_info *fi)
 {
-     function<bool()> pred = [&]()
-	    {
-		 for(const auto& x : paths)
-		      if(frozen_files.count(x))
-			   return true;
-		 return false;
-	    };
-     wuutkl(pred);
-}
+     //With writeback caching the kernel reads pages in to fill in
+     //partial writes, even through write-only files, and works out
+     //where appends go itself.
+     if(writeback)
+     {
+          if((fi->flags & O_ACCMODE) == O_WRONLY)
+               fi->flags = (fi->flags & ~O_ACCMODE) | O_RDWR;
+          fi->flags &= ~O_APPEND;
+     }
+     //libfuse hands truncating opens to us whole (atomic O_TRUNC), so
+     //the truncate is done below, the way tefs_truncate does it.
+     bool truncating = (fi->flags & O_TRUNC) && (fi->flags & O_ACCMODE) != O_RDONLY;
+     int fd = open(fname.c_str(), truncating ? fi->flags & ~O_TRUNC : fi->flags, mode);
+     if (fd == -1)
+     {
+          resign(path);
+          return -errno;
+     }
 
-static string handle_read(const char* path)
-{
-     wuutkl(path);
-     
-     if(two_way)
+     //Register while still holding path so a copy-up can't slip in
+     //between resolving the layer and recording it.
+     auto of = new open_file{fd,fi->flags,path,is_upper(fname),0};
+     if(of->on_upper)
      {
-          bool lower_already_checked = false;
-          if(exists(upper+"/"+path))
+          upper_hits++;
+          touch(path);
+     }
+     else
+          upper_misses++;
+     struct stat st;
+     if(!of->on_upper && !fstat(fd,&st))
+          of->cache_id = blocks.file_id(st);
+     if(of->on_upper && !fstat(fd,&st) && S_ISREG(st.st_mode) && st.st_size >= CHUNKMAP_CHUNK &&
+        chunk_map::marked(fd) && !load_partial(path))
+     {
+          //Half copied up, and we can't get at the rest.
+          resign(path);
+          close(fd);
+          delete of;
+          return -EIO;
+     }
+     if(truncating)
+     {
+          //A partial file must stop fetching what's cut off.
+          int res = 0;
+          auto pf = of->on_upper ? find_partial(path) : nullptr;
+          if(pf)
           {
-               struct stat buffer;
-               time_t utime, ltime;
-               
-               lstat((upper+"/"+path).c_str(),&buffer);
-               utime = buffer.st_mtime;
-               if(utime < 0)
-                    utime = 0;
-
-               if(exists(lower+"/"+path))
-               {
-                    lstat((lower+"/"+path).c_str(),&buffer);
-                    ltime = buffer.st_mtime;
-                    if(ltime < 0)
-                         ltime = 0;
-                    lower_already_checked = true;
-               }
-               else
-                    ltime = 0;
-
-               if(utime >= ltime)
-                    return upper+"/"+path;
-
-               //Otherwise, both exist but lower is newer
-               //Delete upper file and quash any pending commits
-               plocklib_acquire_simple_lock(&pending_commits_lock);
-               unlink((upper+"/"+path).c_str());
-               remove_if(pending_commits.begin(),pending_commits.end(),
-                         [&](pair<string,time_t> x)
-                         {
-                              return x.first==path;
-                         });
-               plocklib_release_simple_lock(&pending_commits_lock);
+               plocklib_acquire_simple_lock(&pf->lock);
+               res = prepare_partial_truncate(*pf,0);
+               if(!res && ftruncate(fd,0)==-1)
+                    res = -errno;
+               plocklib_release_simple_lock(&pf->lock);
           }
-          if(lower_already_checked || exists(lower+"/"+path))
+          else if(ftruncate(fd,0)==-1)
+               res = -errno;
+          if(res)
           {
-               plocklib_acquire_simple_lock(&pending_commits_lock);
-               if(find_if(pending_luc.begin(),pending_luc.end(),
-                          [&](pair<string,time_t> x)
-                          {
-                               return x.first==path;
-                          })==pending_luc.end())
-                    pending_luc.emplace_back(path,time(NULL)+DELAY_TIME);
-               plocklib_release_simple_lock(&pending_commits_lock);
-               return lower+"/"+path;
+               resign(path);
+               close(fd);
+               delete of;
+               return res;
           }
+          //All of it is gone, and reads as zeros if the file grows again.
+          if(of->on_upper)
+               add_dirty_commit(path,0,numeric_limits<off_t>::max());
      }
-     else
-          if(exists(upper+"/"+path))
-               return upper+"/"+path;
-          else if(exists(lower+"/"+path))
-               return lower+"/"+path;
-     
-     return upper+"/"+path;
+     plocklib_acquire_simple_lock(&open_files_lock);
+     open_files[path].insert(of);
+     plocklib_release_simple_lock(&open_files_lock);
+     resign(path);
+
+     fi->fh = (uint64_t) of;
+     fi->keep_cache = config.keep_cache;
+     return 0;
 }
 
-static string handle_write(const char* path)
+static int tefs_open(const char *path, struct fuse_file_info *fi)
 {
-     wuutkl(path);
-     
-     if(two_way)
-          handle_read(path);
+     if(reserved(path))
+          return open_stats(path, fi);
 
-     auto add_pending_commit = [&]()
+     string fname;
+     if((fi->flags & O_ACCMODE) == O_RDONLY)
+          fname = handle_read(path);
+     else
+          fname = handle_write(path);
+     if(fname.empty())
      {
-          plocklib_acquire_simple_lock(&pending_commits_lock);
-          pending_commits.remove_if([&](pair<string,time_t> x)
-          {
-               return x.first==path;
-          });
-          pending_luc.remove_if([&](pair<string,time_t> x)
-          {
-               return x.first==path;
-          });
-          pending_commits.emplace_back(path,time(NULL)+DELAY_TIME);
-          plocklib_release_simple_lock(&pending_commits_lock);
-     };
+          resign(path);
+          return -errno;
+     }
 
-     if(exists(upper+"/"+path) && !special(upper+"/"+path))
+     return open_resolved(path, fname, 0, fi);
+}
+
+static int tefs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+     if(reserved(path))
+          return -EPERM;
+
+     string fname = handle_write(path);
+     if(fname.empty())
      {
-          add_pending_commit();
-          return upper+"/"+path;
+          resign(path);
+          return -errno;
      }
-     else if(exists(upper+"/"+path))
-          return upper+"/"+path;
-     
-     string rpath = upper+"/"+string{path}.substr(0,string{path}.rfind("/"));
-     string lpath = lower+"/"+string{path}.substr(0,string{path}.rfind("/"));
-     if(exists(lpath))
-     {
-          while(!plocklib_request_writer_promotion(&frozen_files_lock))
-               plocklib_become_reader(&frozen_files_lock);
-          frozen_files.insert(string{path}.substr(0,string{path}.rfind("/")));
-          if(exists(lower+"/"+path))
-               frozen_files.insert(path);
-          plocklib_resign_as_writer(&frozen_files_lock);
 
-          auto child_pid = fork();
-          if(!child_pid)
-               execlp("mkdir","mkdir","-p",rpath.c_str(),NULL);
-          else
-               waitpid(child_pid,NULL,0);
-          if(exists(lower+"/"+path))
-          {
-               child_pid = fork();
-               if(!child_pid)
-                    execlp("cp","cp","-a",(lower+"/"+path).c_str(),rpath.c_str(),NULL);
-               else
-                    waitpid(child_pid,NULL,0);
-          }
+     fi->flags |= O_CREAT;
+     int res = open_resolved(path, fname, mode | S_IRUSR | S_IWUSR, fi);
+     if(!res)
+     {
+          remember(path,layer_cache::UPPER);
+          listing_changed(path);
+     }
+     return res;
+}
 
-          plocklib_become_reader(&frozen_files_lock);
-          while(!plocklib_request_writer_promotion(&frozen_files_lock))
-               plocklib_become_reader(&frozen_files_lock);
-          frozen_files.erase(string{path}.substr(0,string{path}.rfind("/")));
-          if(exists(lower+"/"+path))
-               frozen_files.erase(path);
-          plocklib_resign_as_writer(&frozen_files_lock);
+/*Read size bytes at offset, handing reply a fuse_bufvec of where they
+  are.  Mostly that's a range of the open file itself, which libfuse
+  can splice to the kernel without it passing through here; blocks
+  from the block cache are the exception.  Everything stays held until
+  reply returns, so the file can't be copied up or rebound in the
+  middle.*/
+template<typename Reply>
+static int tefs_read_buf(const char *path, size_t size, off_t offset,
+                         struct fuse_file_info *fi, Reply reply)
+{
+     auto of = (open_file*) fi->fh;
+     int res = 0;
+     vector<fuse_buf> bufs;
+     vector<char> data;
 
-          wuutkl(path);
+     wuutkl(path);
+     auto pf = of->on_upper ? find_partial(path) : nullptr;
+     if(pf)
+     {
+          plocklib_acquire_simple_lock(&pf->lock);
+          ssize_t len = map_partial(*pf, of->fd, size, offset, bufs);
+          if(len < 0)
+               res = len;
+     }
+     else if (!of->on_upper && of->cache_id)
+     {
+          //In two-way mode the lower file can change while it's
+          //open, and blocks of the old one mustn't be served.
+          uint64_t id = of->cache_id;
+          struct stat st;
+          if(two_way && !fstat(of->fd,&st))
+               id = blocks.file_id(st);
+          data.resize(size);
+          ssize_t len = blocks.read(id, of->fd, data.data(), size, offset);
+          if (len == -1)
+               res = -errno;
+          else
+               bufs.push_back({(size_t) len, (fuse_buf_flags) 0, data.data(), -1, 0});
      }
      else
-          return upper+"/"+path;
-     
-     add_pending_commit();
-     return upper+"/"+path;
-}
+          bufs.push_back({size, (fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK), NULL, of->fd, offset});
 
-static int tefs_getattr(const char *path, struct stat *stbuf)
-{
-     string fname = handle_read(path);
-     
-     int res;
-     res = lstat(fname.c_str(), stbuf);
-     plocklib_resign_as_reader(&frozen_files_lock);
-     if (res == -1)
-          return -errno;
-     
-     return 0;
+     if(!res)
+     {
+          vector<char> vec(sizeof(fuse_bufvec) + bufs.size()*sizeof(fuse_buf));
+          auto bufv = (fuse_bufvec*) vec.data();
+          bufv->count = bufs.size();
+          bufv->idx = 0;
+          bufv->off = 0;
+          copy(bufs.begin(), bufs.end(), bufv->buf);
+          reply(bufv);
+     }
+     if(pf)
+          plocklib_release_simple_lock(&pf->lock);
+     resign(path);
+     return res;
 }
 
-static int tefs_access(const char *path, int mask)
+//Write bufv at offset, splicing it into the file when it comes as a
+//pipe.
+static int tefs_write_buf(const char *path, struct fuse_bufvec *bufv,
+                          off_t offset, struct fuse_file_info *fi)
 {
-     string fname = handle_read(path);
-     
+     auto of = (open_file*) fi->fh;
+     size_t size = fuse_buf_size(bufv);
+     struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+     dst.buf[0].flags = (fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+     dst.buf[0].fd = of->fd;
+     dst.buf[0].pos = offset;
      int res;
-     res = access(fname.c_str(), mask);
-     plocklib_resign_as_reader(&frozen_files_lock);
-     if (res == -1)
-          return -errno;
 
-     return 0;
+     wuutkl(path);
+     auto pf = of->on_upper ? find_partial(path) : nullptr;
+     if(pf)
+     {
+          plocklib_acquire_simple_lock(&pf->lock);
+          res = prepare_partial_write(*pf, offset, offset+size);
+          if(!res)
+               res = fuse_buf_copy(&dst, bufv, (fuse_buf_copy_flags) 0);
+          plocklib_release_simple_lock(&pf->lock);
+     }
+     else
+          res = fuse_buf_copy(&dst, bufv, (fuse_buf_copy_flags) 0);
+     
+     resign(path);
+     if (res >= 0)
+     {
+          of->written = true;
+          add_dirty_commit(path,offset,offset+res);
+     }
+     else if (res == -ENOSPC)
+          kick_space_manager();
+     return res;
 }
 
-static int tefs_readlink(const char *path, char *buf, size_t size)
+static int tefs_statfs(const char *path, struct statvfs *stbuf)
 {
-     string fname = handle_read(path);
-     
      int res;
-     res = readlink(fname.c_str(), buf, size - 1);
-     plocklib_resign_as_reader(&frozen_files_lock);
+
+     //Upper is only a cache; how much fits is up to lower.
+     res = statvfs(lower.c_str(), stbuf);
+     if (res == -1)
+          res = statvfs(upper.c_str(), stbuf);
      if (res == -1)
           return -errno;
 
-     buf[res] = '\0';
      return 0;
 }
 
-static int tefs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                        off_t offset, struct fuse_file_info *fi)
+static int tefs_release(const char *path, struct fuse_file_info *fi)
 {
-     string fname = handle_read(path);
-     map<string,struct stat> file_map;
-     
-     DIR *dp;
-     struct dirent *de;
-
-     (void) offset;
-     (void) fi;
+     auto of = (open_file*) fi->fh;
 
-     dp = opendir(fname.c_str());
-     if (dp == NULL)
+     (void) path;
+     plocklib_acquire_simple_lock(&open_files_lock);
+     string where = of->path;
+     auto it = open_files.find(of->path);
+     if(it!=open_files.end())
      {
-          plocklib_resign_as_reader(&frozen_files_lock);
-          return -errno;
+          it->second.erase(of);
+          if(it->second.empty())
+               open_files.erase(it);
      }
+     plocklib_release_simple_lock(&open_files_lock);
 
-     while ((de = readdir(dp)) != NULL)
+     if(config.commit_on_close && of->written && where.size())
      {
-          struct stat st;
-          memset(&st, 0, sizeof(st));
-          st.st_ino = de->d_ino;
-          st.st_mode = de->d_type << 12;
-          file_map.insert(pair<string,struct stat>(de->d_name,st));
-     }
-     closedir(dp);
-     
-     if(fname.find(upper)==0 && (dp = opendir((lower+"/"+path).c_str()))!=NULL)
-     {
-          while ((de = readdir(dp)) != NULL)
-          {
-               struct stat st;
-               memset(&st, 0, sizeof(st));
-               st.st_ino = de->d_ino;
-               st.st_mode = de->d_type << 12;
-               file_map.insert(pair<string,struct stat>(de->d_name,st));
-          }
-          closedir(dp);
+          plocklib_acquire_simple_lock(&pending_commits_lock);
+          expedite(where);
+          plocklib_release_simple_lock(&pending_commits_lock);
      }
-
-     for(const auto& entry : file_map)
-          if(filler(buf, entry.first.c_str(), &entry.second, 0))
-               break;
-     
-     plocklib_resign_as_reader(&frozen_files_lock);
+     close(of->fd);
+     delete of;
      return 0;
 }
 
-static int tefs_mknod(const char *path, mode_t mode, dev_t rdev)
+static int tefs_fsync(const char *path, int isdatasync,
+                      struct fuse_file_info *fi)
 {
-     mode |= S_IRUSR | S_IWUSR;
-     
-     string fname;
-     if(S_ISREG(mode))
-          fname = handle_write(path);
-     else
-     {
-          wuutkl(path);
-          fname = upper+"/"+path;
-     }
-     
+     auto of = (open_file*) fi->fh;
      int res;
 
-     /* On Linux this could just be 'mknod(path, mode, rdev)' but this
-        is more portable */
-     if (S_ISREG(mode)) {
-          res = open(fname.c_str(), O_CREAT | O_EXCL | O_WRONLY, mode);
-          if (res >= 0)
-               res = close(res);
-     } else if (S_ISFIFO(mode))
-          res = mkfifo(fname.c_str(), mode);
+     if (isdatasync)
+          res = fdatasync(of->fd);
      else
-          res = mknod(fname.c_str(), mode, rdev);
-
-     plocklib_resign_as_reader(&frozen_files_lock);
+          res = fsync(of->fd);
      if (res == -1)
           return -errno;
 
-     return 0;
+     //The bitmap has to be as durable as the chunks it covers.
+     auto pf = of->on_upper && *path ? find_partial(path) : nullptr;
+     if(pf)
+     {
+          plocklib_acquire_simple_lock(&pf->lock);
+          res = save_chunks(*pf);
+          plocklib_release_simple_lock(&pf->lock);
+          if(res)
+               return res;
+     }
+     //Unlinked: there's nothing in lower to update.
+     if(!*path)
+          return 0;
+
+     //Upper's copy is durable now, so the record that it still has to
+     //go to lower has to be too, or a crash would forget it.
+     if(of->on_upper && (res = journal.sync()))
+          return res;
+
+     //Only a whole file can be committed.
+     if(durable_lower && pf)
+     {
+          if((res = complete_partial(*pf)))
+               return res;
+          finish_partial(path,pf);
+     }
+
+     //Either way, it goes to lower ahead of the bulk commits.
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     expedite(path);
+     if(durable_lower)
+          res = wait_for_commit(path);
+     plocklib_release_simple_lock(&pending_commits_lock);
+     return res;
 }
 
-static int tefs_mkdir(const char *path, mode_t mode)
+#ifdef HAVE_POSIX_FALLOCATE
+static int tefs_fallocate(const char *path, int mode,
+                          off_t offset, off_t length, struct fuse_file_info *fi)
 {
-     mode |= S_IRUSR | S_IWUSR;
-
-     string fname = handle_write(path);
+     auto of = (open_file*) fi->fh;
      int res;
 
-     res = mkdir(fname.c_str(), mode);
-     mkdir((lower+"/"+path).c_str(),mode);
+     if (mode)
+          return -EOPNOTSUPP;
+
+     wuutkl(path);
+     res = -posix_fallocate(of->fd, offset, length);
+     resign(path);
+     if (!res)
+     {
+          of->written = true;
+          add_dirty_commit(path,offset,offset+length);
+     }
+     return res;
+}
+#endif
 
-     plocklib_resign_as_reader(&frozen_files_lock);
-     if (res == -1)
-          return -errno;
+/*Low-level entry points: turn node ids into paths, call the tefs_*
+  operation for them, and reply.*/
 
-     return 0;
+//Where an open file is now, or "" if it has been unlinked.
+static string handle_path(open_file* of)
+{
+     plocklib_acquire_simple_lock(&open_files_lock);
+     string to_return = of->path;
+     plocklib_release_simple_lock(&open_files_lock);
+     return to_return;
 }
 
-static int tefs_unlink(const char *path)
+/*Reply to a request that created or found name in parent, at path.
+  With negative, a name that isn't there is cached as missing for as
+  long as a name that is.*/
+static void reply_entry(fuse_req_t req, fuse_ino_t parent, const char* name, const string& path,
+                        struct fuse_file_info* fi = NULL, bool negative = false)
 {
-     wuutkl(path);
-     plocklib_acquire_simple_lock(&pending_commits_lock);
-     remove_if(pending_commits.begin(),pending_commits.end(),
-               [&](pair<string,time_t> x)
-               {
-                    return x.first==path;
-               });
-     remove_if(pending_luc.begin(),pending_luc.end(),
-               [&](pair<string,time_t> x)
-               {
-                    return x.first==path;
-               });
-     plocklib_release_simple_lock(&pending_commits_lock);
-     
-     int res;
-     res = unlink((lower+"/"+path).c_str());
-     res = unlink((upper+"/"+path).c_str())==-1 ? res : 0;
+     struct fuse_entry_param e;
+     memset(&e, 0, sizeof(e));
+     int res = tefs_getattr(path.c_str(), &e.attr);
+     if (res == -ENOENT && negative)
+     {
+          e.entry_timeout = entry_timeout;
+          fuse_reply_entry(req, &e);
+          return;
+     }
+     if (res)
+     {
+          if (fi)
+               tefs_release(path.c_str(), fi);
+          fuse_reply_err(req, -res);
+          return;
+     }
+     e.ino = remember_child(parent, name);
+     e.attr_timeout = attr_timeout;
+     e.entry_timeout = entry_timeout;
 
-     plocklib_resign_as_reader(&frozen_files_lock);
-     if (res == -1)
-          return -errno;
+     //If the kernel never hears about it, it will never forget it.
+     if (fi ? fuse_reply_create(req, &e, fi) : fuse_reply_entry(req, &e))
+     {
+          forget_inode(e.ino, 1);
+          if (fi)
+               tefs_release(path.c_str(), fi);
+     }
+}
 
-     return 0;
+static void tefs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+     //Data goes straight between the layer files and the kernel.
+     unsigned splice = FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+     conn->want |= conn->capable & splice;
+     conn->max_write = config.max_write;
+     conn->max_readahead = config.max_write;
+     //Writes are cached by the kernel and come here in big batches;
+     //it keeps sizes and mtimes itself and sends them on with
+     //setattr.
+     if (config.writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+     {
+          conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+          writeback = true;
+     }
+     else if (config.writeback)
+          cerr << "Kernel can't cache writes; writeback disabled" << endl;
 }
 
-static int tefs_rmdir(const char *path)
+static void tefs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-     wuutkl(path);
-     plocklib_acquire_simple_lock(&pending_commits_lock);
-     remove_if(pending_commits.begin(),pending_commits.end(),
-               [&](pair<string,time_t> x)
-               {
-                    return x.first==path;
-               });
-     remove_if(pending_luc.begin(),pending_luc.end(),
-               [&](pair<string,time_t> x)
-               {
-                    return x.first==path;
-               });
-     plocklib_release_simple_lock(&pending_commits_lock);
+     op_timer timer(OP_LOOKUP);
+     string path;
+     if (!child_path(parent, name, path))
+          fuse_reply_err(req, ENOENT);
+     else
+          reply_entry(req, parent, name, path, NULL, true);
+}
 
-     int res;
-     res = rmdir((lower+"/"+path).c_str());
-     res = rmdir((upper+"/"+path).c_str())==-1 ? res : 0;
-     plocklib_resign_as_reader(&frozen_files_lock);
-     if (res == -1)
-          return -errno;
+static void tefs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+     op_timer timer(OP_FORGET);
+     forget_inode(ino, nlookup);
+     fuse_reply_none(req);
+}
 
-     return 0;
+static void tefs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+     op_timer timer(OP_FORGET);
+     for (size_t i = 0; i < count; i++)
+          forget_inode(forgets[i].ino, forgets[i].nlookup);
+     fuse_reply_none(req);
 }
 
-static int tefs_symlink(const char *from, const char *to)
+static void tefs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-     string fname = handle_write(to);
+     op_timer timer(OP_GETATTR);
+     struct stat st;
+     string path;
      int res;
+     if (inode_path(ino, path))
+          res = tefs_getattr(path.c_str(), &st);
+     else if (fi && fstat(((open_file*) fi->fh)->fd, &st) != -1)
+          res = 0;
+     else
+          res = -ENOENT;
 
-     res = symlink(from, fname.c_str());
-     plocklib_resign_as_reader(&frozen_files_lock);
-     if (res == -1)
-          return -errno;
-     
-     plocklib_acquire_simple_lock(&pending_commits_lock);
-     pending_commits.emplace_back(to,time(NULL)+DELAY_TIME);
-     plocklib_release_simple_lock(&pending_commits_lock);
-     return 0;
+     if (res)
+          fuse_reply_err(req, -res);
+     else
+          fuse_reply_attr(req, &st, attr_timeout);
 }
 
-static int tefs_rename(const char *from, const char *to)
+//The times a setattr asks for, as for utimensat.
+static void setattr_times(const struct stat *attr, int to_set, struct timespec ts[2])
 {
-     string fdir = string{from}+"/";
-     string tdir = string{to}+"/";
-     
-     string from_name = handle_write(from);
-     struct stat buf;
-     lstat(from_name.c_str(),&buf);
-     plocklib_resign_as_reader(&frozen_files_lock);
+     ts[0].tv_nsec = UTIME_OMIT;
+     ts[1].tv_nsec = UTIME_OMIT;
+     if (to_set & FUSE_SET_ATTR_ATIME_NOW)
+          ts[0].tv_nsec = UTIME_NOW;
+     else if (to_set & FUSE_SET_ATTR_ATIME)
+          ts[0] = attr->st_atim;
+     if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+          ts[1].tv_nsec = UTIME_NOW;
+     else if (to_set & FUSE_SET_ATTR_MTIME)
+          ts[1] = attr->st_mtim;
+}
 
-     string to_name = handle_write(to);
-     plocklib_resign_as_reader(&frozen_files_lock);
+//setattr on a file that is open but unlinked: there's no path to go
+//through, and nothing in lower to change, so it's just the descriptor.
+static int setattr_fd(int fd, struct stat *attr, int to_set)
+{
+     int res = 0;
+     if (to_set & FUSE_SET_ATTR_MODE)
+          res = fchmod(fd, attr->st_mode | S_IRUSR | S_IWUSR);
+     if (res != -1 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+          res = fchown(fd,
+                       (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1,
+                       (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1);
+     if (res != -1 && (to_set & FUSE_SET_ATTR_SIZE))
+          res = ftruncate(fd, attr->st_size);
+     if (res != -1 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)))
+     {
+          struct timespec ts[2];
+          setattr_times(attr, to_set, ts);
+          res = futimens(fd, ts);
+     }
+     return res == -1 ? -errno : 0;
+}
 
-     plocklib_acquire_simple_lock(&active_commits_lock);
-     
-     if(S_ISDIR(buf.st_mode))
+static void tefs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                            int to_set, struct fuse_file_info *fi)
+{
+     op_timer timer(OP_SETATTR);
+     string path;
+     int res = 0;
+     if (!inode_path(ino, path))
      {
-          function<bool()> subpath_pred = [&]()
-               {
-                    for(auto x : frozen_files)
-                         if(!x.find(fdir))
-                              return true;
-                    return false;
-               };
-          wuutkl(subpath_pred);
-          
-          plocklib_acquire_simple_lock(&pending_commits_lock);
-          transform(pending_commits.begin(),pending_commits.end(),pending_commits.begin(),
-                    [&](const auto& x)
-                    {
-                         string newpath = x.first;
-                         if(!newpath.find(fdir))
-                              newpath.replace(0,fdir.length(),tdir);
-                         return make_pair(newpath,x.second);
-                    });
-          plocklib_release_simple_lock(&pending_commits_lock);
+          //ftruncate(), fchmod() and the like on an unlinked file.
+          res = fi ? setattr_fd(((open_file*) fi->fh)->fd, attr, to_set) : -ENOENT;
+          if (res)
+               fuse_reply_err(req, -res);
+          else
+               tefs_ll_getattr(req, ino, fi);
+          return;
+     }
 
-          rename((lower+"/"+from).c_str(),(lower+"/"+to).c_str());
+     if (to_set & FUSE_SET_ATTR_MODE)
+          res = tefs_chmod(path.c_str(), attr->st_mode);
+     if (!res && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)))
+          res = tefs_chown(path.c_str(),
+                           (to_set & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1,
+                           (to_set & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1);
+     if (!res && (to_set & FUSE_SET_ATTR_SIZE))
+          res = tefs_truncate(path.c_str(), attr->st_size);
+     if (!res && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)))
+     {
+          struct timespec ts[2];
+          setattr_times(attr, to_set, ts);
+          res = tefs_utimens(path.c_str(), ts);
+     }
+     if (res)
+     {
+          fuse_reply_err(req, -res);
+          return;
      }
-     else
-          wuutkl({from,to});
 
-     int res;
-     res = rename(from_name.c_str(), to_name.c_str());
-     
-     plocklib_release_simple_lock(&active_commits_lock);
-     plocklib_resign_as_reader(&frozen_files_lock);
-     if (res == -1)
-          return -errno;
+     tefs_ll_getattr(req, ino, fi);
+}
 
-     tefs_unlink(from);
-     return 0;
+static void tefs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+     op_timer timer(OP_READLINK);
+     char buf[PATH_MAX + 1];
+     string path;
+     int res = inode_path(ino, path) ? tefs_readlink(path.c_str(), buf, sizeof(buf)) : -ENOENT;
+     if (res)
+          fuse_reply_err(req, -res);
+     else
+          fuse_reply_readlink(req, buf);
 }
 
-static int tefs_chmod(const char *path, mode_t mode)
+static void tefs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode, dev_t rdev)
 {
-     mode |= S_IRUSR | S_IWUSR;
-     if(exists(upper+"/"+path))
-          chmod((upper+path).c_str(), mode);
-     if(exists(lower+"/"+path))
-          if(!fork())
-          {
-               chmod((lower+path).c_str(), mode);
-               exit(0);
-          }
-     
-     return 0;
+     op_timer timer(OP_MKNOD);
+     string path;
+     int res = child_path(parent, name, path) ? tefs_mknod(path.c_str(), mode, rdev) : -ENOENT;
+     if (res)
+          fuse_reply_err(req, -res);
+     else
+          reply_entry(req, parent, name, path);
 }
 
-static int tefs_chown(const char *path, uid_t uid, gid_t gid)
+static void tefs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 {
-     if(exists(upper+"/"+path))
-          lchown((upper+path).c_str(), uid, gid);
-     if(exists(lower+"/"+path))
-          if(!fork())
-          {
-               lchown((lower+path).c_str(), uid, gid);
-               exit(0);
-          }
-     
-     return 0;
+     op_timer timer(OP_MKDIR);
+     string path;
+     int res = child_path(parent, name, path) ? tefs_mkdir(path.c_str(), mode) : -ENOENT;
+     if (res)
+          fuse_reply_err(req, -res);
+     else
+          reply_entry(req, parent, name, path);
 }
 
-static int tefs_truncate(const char *path, off_t size)
+static void tefs_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
 {
-     string fname = handle_write(path);
-     int res;
+     op_timer timer(OP_SYMLINK);
+     string path;
+     int res = child_path(parent, name, path) ? tefs_symlink(link, path.c_str()) : -ENOENT;
+     if (res)
+          fuse_reply_err(req, -res);
+     else
+          reply_entry(req, parent, name, path);
+}
 
-     res = truncate(fname.c_str(), size);
-     plocklib_resign_as_reader(&frozen_files_lock);
-     if (res == -1)
-          return -errno;
+static void tefs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+     op_timer timer(OP_UNLINK);
+     string path;
+     int res = child_path(parent, name, path) ? tefs_unlink(path.c_str()) : -ENOENT;
+     if (!res)
+          detach_child(parent, name);
+     fuse_reply_err(req, -res);
+}
 
-     return 0;
+static void tefs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+     op_timer timer(OP_RMDIR);
+     string path;
+     int res = child_path(parent, name, path) ? tefs_rmdir(path.c_str()) : -ENOENT;
+     if (!res)
+          detach_child(parent, name);
+     fuse_reply_err(req, -res);
 }
 
-static int tefs_utimens(const char *path, const struct timespec ts[2])
+static void tefs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           fuse_ino_t newparent, const char *newname, unsigned int flags)
 {
-     /* don't use utime/utimes since they follow symlinks */
-     if(exists(upper+"/"+path))
-          utimensat(0, (upper+path).c_str(), ts, AT_SYMLINK_NOFOLLOW);
-     if(exists(lower+"/"+path))
-          if(!fork())
-          {
-               utimensat(0, (lower+path).c_str(), ts, AT_SYMLINK_NOFOLLOW);
-               exit(0);
-          }
-     
-     return 0;
+     op_timer timer(OP_RENAME);
+     if (flags)
+     {
+          fuse_reply_err(req, EINVAL);
+          return;
+     }
+     string from, to;
+     int res = child_path(parent, name, from) && child_path(newparent, newname, to) ?
+          tefs_rename(from.c_str(), to.c_str()) : -ENOENT;
+     if (!res)
+          rename_child(parent, name, newparent, newname);
+     fuse_reply_err(req, -res);
 }
 
-static int tefs_open(const char *path, struct fuse_file_info *fi)
+static void tefs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-     if(fi->flags & O_RDONLY)
-          handle_read(path);
-     else
-          handle_write(path);
-     plocklib_resign_as_reader(&frozen_files_lock);
-     return 0;
+     op_timer timer(OP_OPEN);
+     string path;
+     int res = inode_path(ino, path) ? tefs_open(path.c_str(), fi) : -ENOENT;
+     if (res)
+          fuse_reply_err(req, -res);
+     else if (fuse_reply_open(req, fi))
+          tefs_release(path.c_str(), fi);
 }
 
-static int tefs_read(const char *path, char *buf, size_t size, off_t offset,
-                     struct fuse_file_info *fi)
+static void tefs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           mode_t mode, struct fuse_file_info *fi)
 {
-     string fname = handle_read(path);
-     int fd;
-     int res;
+     op_timer timer(OP_CREATE);
+     string path;
+     int res = child_path(parent, name, path) ? tefs_create(path.c_str(), mode, fi) : -ENOENT;
+     if (res)
+          fuse_reply_err(req, -res);
+     else
+          reply_entry(req, parent, name, path, fi);
+}
 
-     (void) fi;
-     fd = open(fname.c_str(), O_RDONLY);
-     if (fd == -1)
+static void tefs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t off, struct fuse_file_info *fi)
+{
+     op_timer timer(OP_READ);
+     auto of = (open_file*) fi->fh;
+     auto reply = [&](struct fuse_bufvec* bufv)
+          {
+               stats.count(BYTES_READ, fuse_buf_size(bufv));
+               fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+          };
+     string path = handle_path(of);
+     int res = 0;
+     if (path.size())
+          res = tefs_read_buf(path.c_str(), size, off, fi, reply);
+     else
      {
-          plocklib_resign_as_reader(&frozen_files_lock);
-          return -errno;
+          struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(size);
+          bufv.buf[0].flags = (fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+          bufv.buf[0].fd = of->fd;
+          bufv.buf[0].pos = off;
+          reply(&bufv);
      }
 
-     res = pread(fd, buf, size, offset);
-     if (res == -1)
-          res = -errno;
-     close(fd);
-     
-     plocklib_resign_as_reader(&frozen_files_lock);
-     return res;
+     if (res < 0)
+          fuse_reply_err(req, -res);
 }
 
-static int tefs_write(const char *path, const char *buf, size_t size,
-                      off_t offset, struct fuse_file_info *fi)
+static void tefs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+                              off_t off, struct fuse_file_info *fi)
 {
-     string fname = handle_write(path);
-     int fd;
-     int res;
-
-     (void) fi;
-     fd = open(fname.c_str(), O_WRONLY);
-     if (fd == -1)
+     op_timer timer(OP_WRITE);
+     auto of = (open_file*) fi->fh;
+     string path = handle_path(of);
+     ssize_t res;
+     if (path.size())
+          res = tefs_write_buf(path.c_str(), bufv, off, fi);
+     else
      {
-          plocklib_resign_as_reader(&frozen_files_lock);
-          return -errno;
+          struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
+          dst.buf[0].flags = (fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+          dst.buf[0].fd = of->fd;
+          dst.buf[0].pos = off;
+          res = fuse_buf_copy(&dst, bufv, (fuse_buf_copy_flags) 0);
      }
 
-     res = pwrite(fd, buf, size, offset);
-     if (res == -1)
-          res = -errno;
+     if (res < 0)
+          fuse_reply_err(req, -res);
+     else
+     {
+          stats.count(BYTES_WRITTEN, res);
+          fuse_reply_write(req, res);
+     }
+}
 
-     close(fd);
-     
-     plocklib_resign_as_reader(&frozen_files_lock);
-     return res;
+static void tefs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+     op_timer timer(OP_RELEASE);
+     fuse_reply_err(req, -tefs_release(NULL, fi));
 }
 
-static int tefs_statfs(const char *path, struct statvfs *stbuf)
+static void tefs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                          struct fuse_file_info *fi)
 {
-     int res;
+     op_timer timer(OP_FSYNC);
+     string path = handle_path((open_file*) fi->fh);
+     fuse_reply_err(req, -tefs_fsync(path.c_str(), datasync, fi));
+}
 
-     res = statvfs(upper.c_str(), stbuf);
-     if (res == -1)
-          return -errno;
+static void tefs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+     op_timer timer(OP_OPENDIR);
+     string path;
+     auto od = new open_dir;
+     int res = inode_path(ino, path) ? tefs_opendir(path.c_str(), od) : -ENOENT;
+     if (res)
+     {
+          close_dir(od);
+          fuse_reply_err(req, -res);
+          return;
+     }
+     fi->fh = (uint64_t) od;
+     if (fuse_reply_open(req, fi))
+          close_dir(od);
+}
 
-     return 0;
+/*Fill up to size bytes with od's entries from off on.  With plus, each
+  entry carries its attributes and counts as a lookup, so the kernel
+  doesn't have to come back for every one of them.*/
+static void reply_dir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                      open_dir* od, bool plus)
+{
+     vector<char> buf(size);
+     size_t used = 0;
+     seek_dir(od, off);
+     while (next_entry(od))
+     {
+          const auto& entry = od->pending;
+          size_t len;
+          if (plus)
+          {
+               struct fuse_entry_param e;
+               memset(&e, 0, sizeof(e));
+               bool dots = entry.name == "." || entry.name == "..";
+               if (!dots && entry_attr(od, entry.name, &e.attr))
+               {
+                    e.ino = remember_child(ino, entry.name.c_str());
+                    e.attr_timeout = attr_timeout;
+                    e.entry_timeout = entry_timeout;
+               }
+               else
+                    //Listed, but not looked up.
+                    e.attr.st_mode = entry.type << 12;
+               len = fuse_add_direntry_plus(req, buf.data() + used, size - used,
+                                            entry.name.c_str(), &e, od->position + 1);
+               if (len > size - used && e.ino)
+                    forget_inode(e.ino, 1);
+          }
+          else
+          {
+               struct stat st;
+               memset(&st, 0, sizeof(st));
+               st.st_mode = entry.type << 12;
+               len = fuse_add_direntry(req, buf.data() + used, size - used,
+                                       entry.name.c_str(), &st, od->position + 1);
+          }
+          //Doesn't fit: it's the first one next time.
+          if (len > size - used)
+               break;
+          used += len;
+          od->held = false;
+          od->position++;
+     }
+     fuse_reply_buf(req, buf.data(), used);
 }
 
-static int tefs_release(const char *path, struct fuse_file_info *fi)
+static void tefs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t off, struct fuse_file_info *fi)
 {
-     /* Just a stub.	 This method is optional and can safely be left
-        unimplemented */
+     op_timer timer(OP_READDIR);
+     reply_dir(req, ino, size, off, (open_dir*) fi->fh, false);
+}
 
-     (void) path;
-     (void) fi;
-     return 0;
+static void tefs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                off_t off, struct fuse_file_info *fi)
+{
+     op_timer timer(OP_READDIR);
+     reply_dir(req, ino, size, off, (open_dir*) fi->fh, true);
 }
 
-static int tefs_fsync(const char *path, int isdatasync,
-                      struct fuse_file_info *fi)
+static void tefs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-     /* Just a stub.	 This method is optional and can safely be left
-        unimplemented */
+     op_timer timer(OP_RELEASEDIR);
+     close_dir((open_dir*) fi->fh);
+     fuse_reply_err(req, 0);
+}
 
-     (void) path;
-     (void) isdatasync;
-     (void) fi;
-     return 0;
+static void tefs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+     op_timer timer(OP_STATFS);
+     struct statvfs st;
+     int res = tefs_statfs("/", &st);
+     if (res)
+          fuse_reply_err(req, -res);
+     else
+          fuse_reply_statfs(req, &st);
 }
 
-#ifdef HAVE_POSIX_FALLOCATE
-static int tefs_fallocate(const char *path, int mode,
-                          off_t offset, off_t length, struct fuse_file_info *fi)
+static void tefs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                             const char *value, size_t size, int flags)
 {
-     int fd;
-     int res;
+     op_timer timer(OP_SETXATTR);
+     string path;
+     fuse_reply_err(req, inode_path(ino, path) ? -tefs_setxattr(path.c_str(), name, value, size, flags) : ENOENT);
+}
 
-     (void) fi;
+static void tefs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+     op_timer timer(OP_GETXATTR);
+     string path;
+     if (!inode_path(ino, path))
+     {
+          fuse_reply_err(req, ENOENT);
+          return;
+     }
+     vector<char> buf(size);
+     ssize_t res = tefs_getxattr(path.c_str(), name, buf.data(), size);
+     if (res < 0)
+          fuse_reply_err(req, -res);
+     else if (!size)
+          fuse_reply_xattr(req, res);
+     else
+          fuse_reply_buf(req, buf.data(), res);
+}
 
-     if (mode)
-          return -EOPNOTSUPP;
+static void tefs_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
+{
+     op_timer timer(OP_LISTXATTR);
+     string path;
+     if (!inode_path(ino, path))
+     {
+          fuse_reply_err(req, ENOENT);
+          return;
+     }
+     vector<char> buf(size);
+     ssize_t res = tefs_listxattr(path.c_str(), buf.data(), size);
+     if (res < 0)
+          fuse_reply_err(req, -res);
+     else if (!size)
+          fuse_reply_xattr(req, res);
+     else
+          fuse_reply_buf(req, buf.data(), res);
+}
 
-     fd = open(path, O_WRONLY);
-     if (fd == -1)
-          return -errno;
+static void tefs_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+     op_timer timer(OP_REMOVEXATTR);
+     string path;
+     fuse_reply_err(req, inode_path(ino, path) ? -tefs_removexattr(path.c_str(), name) : ENOENT);
+}
 
-     res = -posix_fallocate(fd, offset, length);
+static void tefs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+     op_timer timer(OP_ACCESS);
+     string path;
+     fuse_reply_err(req, inode_path(ino, path) ? -tefs_access(path.c_str(), mask) : ENOENT);
+}
 
-     close(fd);
-     return res;
+#ifdef HAVE_POSIX_FALLOCATE
+static void tefs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                              off_t offset, off_t length, struct fuse_file_info *fi)
+{
+     op_timer timer(OP_FALLOCATE);
+     string path = handle_path((open_file*) fi->fh);
+     fuse_reply_err(req, path.size() ? -tefs_fallocate(path.c_str(), mode, offset, length, fi) : ENOENT);
 }
 #endif
 
-static struct fuse_operations tefs_oper = {
-	.getattr	= tefs_getattr,
-	.access		= tefs_access,
-	.readlink	= tefs_readlink,
-	.readdir	= tefs_readdir,
-	.mknod		= tefs_mknod,
-	.mkdir		= tefs_mkdir,
-	.symlink	= tefs_symlink,
-	.unlink		= tefs_unlink,
-	.rmdir		= tefs_rmdir,
-	.rename		= tefs_rename,
-//	.link		= tefs_link,
-	.chmod		= tefs_chmod,
-	.chown		= tefs_chown,
-	.truncate	= tefs_truncate,
-	.utimens	= tefs_utimens,
-	.open		= tefs_open,
-	.read		= tefs_read,
-	.write		= tefs_write,
-	.statfs		= tefs_statfs,
-	.release	= tefs_release,
-	.fsync		= tefs_fsync,
+static const struct fuse_lowlevel_ops tefs_ll_oper = {
+	.init		= tefs_ll_init,
+	.lookup		= tefs_ll_lookup,
+	.forget		= tefs_ll_forget,
+	.getattr	= tefs_ll_getattr,
+	.setattr	= tefs_ll_setattr,
+	.readlink	= tefs_ll_readlink,
+	.mknod		= tefs_ll_mknod,
+	.mkdir		= tefs_ll_mkdir,
+	.unlink		= tefs_ll_unlink,
+	.rmdir		= tefs_ll_rmdir,
+	.symlink	= tefs_ll_symlink,
+	.rename		= tefs_ll_rename,
+//	.link		= tefs_ll_link,
+	.open		= tefs_ll_open,
+	.read		= tefs_ll_read,
+	.release	= tefs_ll_release,
+	.fsync		= tefs_ll_fsync,
+	.opendir	= tefs_ll_opendir,
+	.readdir	= tefs_ll_readdir,
+	.releasedir	= tefs_ll_releasedir,
+	.statfs		= tefs_ll_statfs,
+	.setxattr	= tefs_ll_setxattr,
+	.getxattr	= tefs_ll_getxattr,
+	.listxattr	= tefs_ll_listxattr,
+	.removexattr	= tefs_ll_removexattr,
+	.access		= tefs_ll_access,
+	.create		= tefs_ll_create,
+	.write_buf	= tefs_ll_write_buf,
+	.forget_multi	= tefs_ll_forget_multi,
 #ifdef HAVE_POSIX_FALLOCATE
-	.fallocate	= tefs_fallocate,
+	.fallocate	= tefs_ll_fallocate,
 #endif
+	.readdirplus	= tefs_ll_readdirplus,
 };
 
+//Queue commits of every upper file lower is missing or has an older
+//copy of, for when the journal can't be trusted.
+void* reconcile_thread(void* ignored)
+{
+     double started = monotonic_now();
+     reconciler scan(upper_fd,lower_fd,config.reconcile_threads,
+                     [](const vector<string>& paths)
+                     {
+                          plocklib_acquire_simple_lock(&pending_commits_lock);
+                          for(const auto& x : paths)
+                               if(!pending_commits.contains(x) && !commit_busy(x))
+                                    queue_commit(x,true);
+                          pthread_cond_broadcast(&commits_cond);
+                          plocklib_release_simple_lock(&pending_commits_lock);
+                     },
+                     [](const string& path)
+                     {
+                          return reserved(path.c_str()) || path.find(".fuse_hidden")!=string::npos ||
+                               path.substr(path.rfind('/')+1).compare(0,11,".tefs-copy.")==0;
+                     });
+     scan.run([&]()
+              {
+                   double elapsed = max(monotonic_now()-started,0.001);
+                   cerr << "Reconcile: " << scan.dirs << " directories, " << scan.files << " files ("
+                        << (unsigned long)(scan.files/elapsed) << "/s), " << scan.differing << " to commit, "
+                        << scan.errors << " errors" << endl;
+              });
+     return NULL;
+}
+
+//Requeue what the journal says was queued when we last stopped.
+static void replay_journal()
+{
+     map<string,char> queued;
+     auto apply = [&](char type, const string& path, const string& other)
+          {
+               if(type=='E')
+                    queued[path] = type;
+               //A commit wins over a copy the other way.
+               else if(type=='L' && !queued.count(path))
+                    queued[path] = type;
+               else if(type=='C' || type=='D')
+               {
+                    auto it = queued.find(path);
+                    if(it!=queued.end() && it->second==(type=='C' ? 'E' : 'L'))
+                         queued.erase(it);
+               }
+               else if(type=='X')
+                    queued.erase(path);
+               else if(type=='R')
+               {
+                    string fdir = path+"/";
+                    map<string,char> moved;
+                    for(auto it = queued.begin(); it!=queued.end();)
+                         if(it->first==path || !it->first.compare(0,fdir.length(),fdir))
+                         {
+                              moved[other+it->first.substr(path.length())] = it->second;
+                              it = queued.erase(it);
+                         }
+                         else
+                              ++it;
+                    queued.insert(moved.begin(),moved.end());
+               }
+          };
+     long records = commit_journal::replay(state_fd,"journal",apply);
+
+     //Commits a crash interrupted go out right away.  Without their
+     //dirty extents they are full copies.
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     for(const auto& x : queued)
+          if(x.second=='E')
+               pending_commits.push(x.first,time(NULL));
+          else
+               pending_luc.push(x.first,time(NULL)+config.commit_delay);
+     if(records>0)
+          cerr << "Replayed " << records << " journal records: " << pending_commits.size()
+               << " commits and " << pending_luc.size() << " copies to upper pending" << endl;
+     plocklib_release_simple_lock(&pending_commits_lock);
+     int res = compact_journal();
+     if(res)
+          cerr << "Compacting the journal failed: " << strerror(-res) << endl;
+}
+
 int main(int argc, char *argv[])
 {
      //Pull out upper and lower paths
@@ -824,27 +4250,136 @@ int main(int argc, char *argv[])
      lower = buf;
      free(buf);
 
+     upper_fd = open(upper.c_str(),O_RDONLY | O_DIRECTORY);
+     lower_fd = open(lower.c_str(),O_RDONLY | O_DIRECTORY);
+     if(upper_fd==-1 || lower_fd==-1)
+     {
+          perror("terminusestfs");
+          return 1;
+     }
+
      //Fix command line parameter list
      argv[argc-3] = argv[argc-1];
      argv[argc-2] = NULL;
      argc-=2;
 
-     pthread_t ct, lt;
-     pthread_create(&ct,NULL,commits_thread,NULL);
+     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+     struct fuse_cmdline_opts opts;
+     if(fuse_opt_parse(&args,&config,tefs_opts,NULL)==-1 || fuse_parse_cmdline(&args,&opts))
+          return 1;
+     if(opts.show_help || !opts.mountpoint)
+     {
+          cerr << "usage: " << argv[0] << " [options] upper_layer lower_layer mountpoint" << endl;
+          fuse_cmdline_help();
+          fuse_lowlevel_help();
+          return opts.show_help ? 0 : 1;
+     }
+     two_way = config.two_way;
+     config.commit_workers = max(1u,config.commit_workers);
+     commit_window = config.commit_workers;
+     config.attr_workers = max(1u,config.attr_workers);
+     //Partial files have to go one at a time, as deltas.
+     config.commit_batch_size = min<unsigned long>(config.commit_batch_size,CHUNKMAP_CHUNK-1);
+     layers.set_capacity(config.layer_cache);
+     listings.set_capacity(config.dir_cache);
+     config.upper_low = min(config.upper_low,config.upper_high);
+     int res = blocks.open(upper_fd,config.block_cache);
+     if(res)
+          cerr << "Block cache disabled: " << strerror(-res) << endl;
+     if(config.durability && strcmp(config.durability,"upper") && strcmp(config.durability,"lower"))
+     {
+          cerr << "durability must be upper or lower" << endl;
+          return 1;
+     }
+     durable_lower = config.durability && !strcmp(config.durability,"lower");
+     policy.set_defaults(config.commit_delay,max(config.commit_delay,config.commit_max_delay));
+     unsigned bad_line = 0;
+     if(config.policy && (res = policy.load(config.policy,bad_line)))
+     {
+          if(bad_line)
+               cerr << config.policy << ":" << bad_line << ": can't parse this rule" << endl;
+          else
+               cerr << config.policy << ": " << strerror(-res) << endl;
+          return 1;
+     }
+
+     //Pick up whatever a crash left queued.
+     mkdirat(upper_fd,".tefs",0700);
+     state_fd = openat(upper_fd,".tefs",O_RDONLY | O_DIRECTORY);
+     if(state_fd==-1 || (res = journal.open(state_fd,"journal")))
+          cerr << "Journal disabled: " << strerror(state_fd==-1 ? errno : -res) << endl;
+     else
+          replay_journal();
+
+     inodes[FUSE_ROOT_ID] = {0,"",1};
+     //In two-way mode lower can change without us knowing, so the
+     //kernel can't trust anything longer than we do.
+     entry_timeout = attr_timeout = two_way ? min(config.cache_timeout,config.layer_ttl) : config.cache_timeout;
+     struct fuse_session* se = fuse_session_new(&args,&tefs_ll_oper,sizeof(tefs_ll_oper),NULL);
+     if(!se)
+          return 1;
+     if(fuse_set_signal_handlers(se) || fuse_session_mount(se,opts.mountpoint))
+     {
+          fuse_session_destroy(se);
+          return 1;
+     }
+     //Going into the background forks, which only keeps this thread.
+     fuse_daemonize(opts.foreground);
+
+     session = se;
+     pthread_t ct, lt, ft, st, jt, nt;
+     for(unsigned i=0; i<config.commit_workers; i++)
+          pthread_create(&ct,NULL,commits_thread,NULL);
+     for(unsigned i=0; i<config.urgent_workers; i++)
+          pthread_create(&ct,NULL,commits_thread,(void*) 1);
      pthread_create(&lt,NULL,luc_thread,NULL);
+     for(unsigned i=0; i<config.attr_workers; i++)
+          pthread_create(&lt,NULL,attrs_thread,NULL);
+     pthread_create(&ft,NULL,fill_thread,NULL);
+     pthread_create(&st,NULL,space_thread,NULL);
+     pthread_create(&jt,NULL,journal_thread,NULL);
+     pthread_create(&nt,NULL,notify_thread,NULL);
+     if(config.reconcile)
+     {
+          pthread_t rt;
+          pthread_create(&rt,NULL,reconcile_thread,NULL);
+          pthread_detach(rt);
+     }
 
-     int to_return = fuse_main(argc, argv, &tefs_oper, NULL);
+     int to_return = opts.singlethread ? fuse_session_loop(se) : fuse_session_loop_mt(se,opts.clone_fd);
+     plocklib_acquire_simple_lock(&session_lock);
+     session = NULL;
+     plocklib_release_simple_lock(&session_lock);
+     fuse_session_unmount(se);
+     fuse_remove_signal_handlers(se);
+     fuse_session_destroy(se);
+     free(opts.mountpoint);
+     fuse_opt_free_args(&args);
 
      //Process all pending commits
-     flush_time = true;
      plocklib_acquire_simple_lock(&pending_commits_lock);
-     while(pending_commits.size())
+     flush_time = true;
+     pthread_cond_broadcast(&commits_cond);
+     while(pending_commits.size() || commits_in_flight || urgent_in_flight || attr_changes.size())
      {
           plocklib_release_simple_lock(&pending_commits_lock);
           sleep(5);
           plocklib_acquire_simple_lock(&pending_commits_lock);
      }
      plocklib_release_simple_lock(&pending_commits_lock);
+     //Everything is in lower now, except for copies to upper, which
+     //can wait for next time, and commits that kept failing or
+     //were waiting on partial files.
+     compact_journal();
+     plocklib_acquire_simple_lock(&pending_commits_lock);
+     if(unflushed.size())
+          cerr << unflushed.size() << " commits kept failing or were waiting on a partial copy-up; they are retried at the next mount" << endl;
+     if(attrs_lost)
+          cerr << attrs_lost << " attribute changes to files only in lower kept failing and were dropped" << endl;
+     plocklib_release_simple_lock(&pending_commits_lock);
+     if(batch_stats.batches)
+          cerr << "Committed " << batch_stats.files << " small files in " << batch_stats.batches << " batches, "
+               << batch_stats.usecs/batch_stats.files << "us per file" << endl;
 
      //TODO
 